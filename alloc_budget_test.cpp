@@ -0,0 +1,133 @@
+// Allocation budgets of VirusGenealogy: read paths must not allocate at
+// all, and create(), connect() and remove() must stay within the budgets
+// below. Build it on its own and run it; it exits non-zero and names the
+// operation when a budget is exceeded.
+//
+//     g++ -std=c++17 -O2 -pthread alloc_budget_test.cpp -o alloc_budget_test
+
+#define ALLOC_COUNTER_IMPLEMENTATION
+#include "alloc_counter.h"
+#include "virus_genealogy.h"
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <cstddef>
+
+namespace {
+
+// Ids long enough to defeat the small string optimization, so that any
+// copy of an id shows up as an allocation.
+class Virus {
+public:
+	typedef std::string id_type;
+
+	Virus(const id_type &id) : id(id) {}
+
+	id_type get_id() const {
+		return id;
+	}
+
+private:
+	id_type id;
+};
+
+// Measured on a small tree with the optional indexes off; the budgets
+// leave some room above that, so that only a real regression trips them.
+constexpr std::size_t create_budget = 24;
+constexpr std::size_t connect_budget = 128;
+// remove() pays per virus it deletes, preview_remove_count() of them.
+constexpr std::size_t remove_budget = 16;
+constexpr std::size_t remove_budget_per_virus = 2;
+
+struct alignas(64) Aligned {
+	char bytes[64];
+};
+
+int failures = 0;
+
+template<class Function>
+void expect(const char *operation, std::size_t budget, Function f) {
+	std::size_t made = AllocationCounter::count(f);
+	if (made > budget) {
+		std::cerr << operation << ": " << made << " allocations, budget " << budget << '\n';
+		++failures;
+	}
+}
+
+std::string name(int i) {
+	return "virus-with-an-id-past-the-small-string-buffer-" + std::to_string(i);
+}
+
+}
+
+int main() {
+	const std::string stem = name(0);
+	VirusGenealogy<Virus> genealogy(stem);
+
+	for (int i = 1; i < 128; ++i) {
+		std::string id = name(i);
+		std::string parent = name(i / 2);
+		expect("create", create_budget, [&] {
+			genealogy.create(id, parent);
+		});
+	}
+
+	for (int i = 3; i < 128; i += 2) {
+		std::string child = name(i);
+		std::string parent = name(i - 1);
+		expect("connect", connect_budget, [&] {
+			genealogy.connect(child, parent);
+		});
+	}
+
+	for (int i = 0; i < 128; ++i) {
+		std::string id = name(i);
+		std::size_t seen = 0;
+		expect("exists", 0, [&] {
+			seen += genealogy.exists(id);
+		});
+		expect("operator[]", 0, [&] {
+			seen += &genealogy[id] != nullptr;
+		});
+		expect("children_view", 0, [&] {
+			for (auto &child : genealogy.children_view(id)) {
+				seen += child.size();
+			}
+		});
+		expect("parents_view", 0, [&] {
+			for (auto &parent : genealogy.parents_view(id)) {
+				seen += parent.size();
+			}
+		});
+		if (seen == 0) {
+			std::cerr << "lookups of " << id << " saw nothing\n";
+			++failures;
+		}
+	}
+
+	for (int i = 127; i > 0; i -= 7) {
+		std::string id = name(i);
+		if (genealogy.exists(id)) {
+			std::size_t removed = genealogy.preview_remove_count(id);
+			expect("remove", remove_budget + remove_budget_per_virus * removed, [&] {
+				genealogy.remove(id);
+			});
+		}
+	}
+
+	// Over-aligned types take the aligned operator new, which must be
+	// counted like any other.
+	if (AllocationCounter::count([] {
+			Aligned *volatile aligned = new Aligned;
+			delete aligned;
+		}) != 1) {
+		std::cerr << "aligned operator new not counted\n";
+		++failures;
+	}
+
+	if (failures == 0) {
+		std::cout << "all allocation budgets hold\n";
+	}
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,159 @@
+#ifndef ALLOC_COUNTER_H
+#define ALLOC_COUNTER_H
+
+#include <cstddef>
+#include <exception>
+
+// Counts heap allocations made by the current thread, so that tests and
+// benchmarks can pin down how many allocations a VirusGenealogy operation
+// performs. The counting operator new and operator delete replace the
+// global ones in the single translation unit that defines
+// ALLOC_COUNTER_IMPLEMENTATION before including this header; without it
+// every count stays zero. alloc_budget_test.cpp is that translation unit
+// for the budgets of VirusGenealogy itself.
+class AllocationBudgetExceeded : public std::exception {
+	virtual const char *what() const throw() {
+		return "AllocationBudgetExceeded";
+	}
+};
+
+class AllocationCounter {
+public:
+	static std::size_t allocations() noexcept {
+		return allocation_count;
+	}
+
+	static std::size_t bytes() noexcept {
+		return allocated_bytes;
+	}
+
+	static void record(std::size_t size) noexcept {
+		++allocation_count;
+		allocated_bytes += size;
+	}
+
+	// Returns the number of allocations f made.
+	template<class Function>
+	static std::size_t count(Function f) {
+		std::size_t before = allocation_count;
+		f();
+		return allocation_count - before;
+	}
+
+	// Runs f and throws AllocationBudgetExceeded if it allocated more than
+	// budget times; a budget of 0 asserts an allocation-free path.
+	template<class Function>
+	static void expect_at_most(std::size_t budget, Function f) {
+		if (count(f) > budget) {
+			throw AllocationBudgetExceeded();
+		}
+	}
+
+private:
+	static inline thread_local std::size_t allocation_count = 0;
+
+	static inline thread_local std::size_t allocated_bytes = 0;
+};
+
+#endif
+
+#if defined(ALLOC_COUNTER_IMPLEMENTATION) && !defined(ALLOC_COUNTER_IMPLEMENTED)
+#define ALLOC_COUNTER_IMPLEMENTED
+
+#include <cstdlib>
+#include <new>
+
+// GCC pairs the inlined malloc and free across these definitions and
+// mistakes them for mismatched new and delete.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpragmas"
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void *operator new(std::size_t size) {
+	AllocationCounter::record(size);
+	if (void *memory = std::malloc(size == 0 ? 1 : size)) {
+		return memory;
+	}
+	throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size) {
+	return operator new(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+	AllocationCounter::record(size);
+	return std::malloc(size == 0 ? 1 : size);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &tag) noexcept {
+	return operator new(size, tag);
+}
+
+void operator delete(void *memory) noexcept {
+	std::free(memory);
+}
+
+void operator delete[](void *memory) noexcept {
+	std::free(memory);
+}
+
+void operator delete(void *memory, std::size_t) noexcept {
+	std::free(memory);
+}
+
+void operator delete[](void *memory, std::size_t) noexcept {
+	std::free(memory);
+}
+
+// Over-aligned types come through these; std::aligned_alloc wants a size
+// that is a multiple of the alignment.
+void *operator new(std::size_t size, std::align_val_t alignment) {
+	AllocationCounter::record(size);
+	std::size_t align = static_cast<std::size_t>(alignment);
+	std::size_t rounded = size == 0 ? align : (size + align - 1) / align * align;
+	if (void *memory = std::aligned_alloc(align, rounded)) {
+		return memory;
+	}
+	throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+	return operator new(size, alignment);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+	try {
+		return operator new(size, alignment);
+	} catch (...) {
+		return nullptr;
+	}
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t &tag) noexcept {
+	return operator new(size, alignment, tag);
+}
+
+void operator delete(void *memory, std::align_val_t) noexcept {
+	std::free(memory);
+}
+
+void operator delete[](void *memory, std::align_val_t) noexcept {
+	std::free(memory);
+}
+
+void operator delete(void *memory, std::size_t, std::align_val_t) noexcept {
+	std::free(memory);
+}
+
+void operator delete[](void *memory, std::size_t, std::align_val_t) noexcept {
+	std::free(memory);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#endif
@@ -0,0 +1,513 @@
+#ifndef ID_INDEX_H
+#define ID_INDEX_H
+
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <iterator>
+#include <utility>
+#include <type_traits>
+#include <cstddef>
+
+// An ordered map from ids to values laid out as a B+ tree: entries live in
+// sorted arrays of up to leaf_capacity keys and values per leaf, and the
+// leaves are chained, so range scans stream through contiguous memory
+// instead of chasing one tree node per entry like std::map.
+//
+// insert() allocates every node a split may need and copies the key
+// before it changes anything, so it leaves the index untouched when it
+// throws. erase() only moves entries between preallocated arrays and frees
+// nodes, so it does not throw as long as moving keys and values does not.
+// Leaves and inner nodes that fall below a quarter full are merged with a
+// neighbour when the two fit in one node.
+template<class Key, class Value, class Compare = std::less<Key>>
+class IdIndex {
+	struct Leaf;
+
+public:
+	static constexpr std::size_t leaf_capacity = 64;
+
+	static constexpr std::size_t inner_capacity = 64;
+
+	template<bool Const>
+	class basic_iterator {
+	public:
+		typedef std::forward_iterator_tag iterator_category;
+		typedef Key value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef const Key *pointer;
+		typedef const Key &reference;
+
+		basic_iterator() : leaf(nullptr), position(0) {}
+
+		template<bool OtherConst, class = typename std::enable_if<Const && !OtherConst>::type>
+		basic_iterator(const basic_iterator<OtherConst> &other)
+			: leaf(other.leaf), position(other.position) {}
+
+		const Key &operator*() const {
+			return leaf->keys[position];
+		}
+
+		const Key *operator->() const {
+			return &leaf->keys[position];
+		}
+
+		const Key &key() const {
+			return leaf->keys[position];
+		}
+
+		typename std::conditional<Const, const Value &, Value &>::type value() const {
+			return leaf->values[position];
+		}
+
+		basic_iterator &operator++() {
+			if (++position == leaf->keys.size()) {
+				leaf = leaf->next;
+				position = 0;
+			}
+			return *this;
+		}
+
+		basic_iterator operator++(int) {
+			basic_iterator previous = *this;
+			++*this;
+			return previous;
+		}
+
+		bool operator==(const basic_iterator &other) const {
+			return leaf == other.leaf && position == other.position;
+		}
+
+		bool operator!=(const basic_iterator &other) const {
+			return !(*this == other);
+		}
+
+	private:
+		friend class IdIndex;
+		template<bool> friend class basic_iterator;
+
+		basic_iterator(Leaf *leaf, std::size_t position) : leaf(leaf), position(position) {}
+
+		Leaf *leaf;
+		std::size_t position;
+	};
+
+	typedef basic_iterator<false> iterator;
+
+	typedef basic_iterator<true> const_iterator;
+
+	IdIndex(const IdIndex &) = delete;
+
+	IdIndex &operator=(const IdIndex &) = delete;
+
+	IdIndex() : root(nullptr), first(nullptr), count(0) {}
+
+	~IdIndex() {
+		destroy(root);
+	}
+
+	std::size_t size() const noexcept {
+		return count;
+	}
+
+	bool empty() const noexcept {
+		return count == 0;
+	}
+
+	iterator begin() noexcept {
+		return iterator(first, 0);
+	}
+
+	iterator end() noexcept {
+		return iterator();
+	}
+
+	const_iterator begin() const noexcept {
+		return const_iterator(first, 0);
+	}
+
+	const_iterator end() const noexcept {
+		return const_iterator();
+	}
+
+	iterator find(const Key &key) {
+		const_iterator it = const_cast<const IdIndex *>(this)->find(key);
+		return iterator(it.leaf, it.position);
+	}
+
+	const_iterator find(const Key &key) const {
+		Leaf *leaf = find_leaf(key);
+		if (leaf == nullptr) {
+			return end();
+		}
+
+		std::size_t position = lower_position(leaf, key);
+		if (position == leaf->keys.size() || compare(key, leaf->keys[position])) {
+			return end();
+		}
+		return const_iterator(leaf, position);
+	}
+
+	// The first entry whose key is not less than key.
+	const_iterator lower_bound(const Key &key) const {
+		Leaf *leaf = find_leaf(key);
+		if (leaf == nullptr) {
+			return end();
+		}
+
+		std::size_t position = lower_position(leaf, key);
+		if (position == leaf->keys.size()) {
+			return const_iterator(leaf->next, 0);
+		}
+		return const_iterator(leaf, position);
+	}
+
+	std::pair<iterator, bool> insert(const Key &key, const Value &value) {
+		if (root == nullptr) {
+			Leaf *leaf = new Leaf();
+			try {
+				leaf->keys.push_back(key);
+				leaf->values.push_back(value);
+			} catch (...) {
+				delete leaf;
+				throw;
+			}
+			root = first = leaf;
+			count = 1;
+			return std::make_pair(iterator(leaf, 0), true);
+		}
+
+		Leaf *leaf = find_leaf(key);
+		std::size_t position = lower_position(leaf, key);
+		if (position < leaf->keys.size() && !compare(key, leaf->keys[position])) {
+			return std::make_pair(iterator(leaf, position), false);
+		}
+
+		Key key_copy(key);
+		Value value_copy(value);
+		if (leaf->keys.size() < leaf_capacity) {
+			leaf->keys.insert(leaf->keys.begin() + position, std::move(key_copy));
+			leaf->values.insert(leaf->values.begin() + position, std::move(value_copy));
+			++count;
+			return std::make_pair(iterator(leaf, position), true);
+		}
+
+		Spares spares;
+		spares.leaf = new Leaf();
+		std::size_t new_inners = 1;
+		for (Inner *inner = leaf->parent; inner != nullptr; inner = inner->parent) {
+			if (inner->children.size() < inner_capacity) {
+				--new_inners;
+				break;
+			}
+			++new_inners;
+		}
+		for (std::size_t i = 0; i < new_inners; ++i) {
+			spares.inners.push_back(nullptr);
+			spares.inners.back() = new Inner();
+		}
+		Key separator = split_key(leaf, position, key);
+
+		leaf->keys.insert(leaf->keys.begin() + position, std::move(key_copy));
+		leaf->values.insert(leaf->values.begin() + position, std::move(value_copy));
+		++count;
+
+		Leaf *right = spares.leaf;
+		spares.leaf = nullptr;
+		std::size_t middle = leaf->keys.size() / 2;
+		std::move(leaf->keys.begin() + middle, leaf->keys.end(), std::back_inserter(right->keys));
+		std::move(leaf->values.begin() + middle, leaf->values.end(), std::back_inserter(right->values));
+		leaf->keys.erase(leaf->keys.begin() + middle, leaf->keys.end());
+		leaf->values.erase(leaf->values.begin() + middle, leaf->values.end());
+		right->next = leaf->next;
+		right->previous = leaf;
+		if (leaf->next != nullptr) {
+			leaf->next->previous = right;
+		}
+		leaf->next = right;
+
+		iterator inserted = position < middle ? iterator(leaf, position) : iterator(right, position - middle);
+		add_child(leaf, right, std::move(separator), spares);
+		return std::make_pair(inserted, true);
+	}
+
+	std::size_t erase(const Key &key) noexcept {
+		Leaf *leaf = find_leaf(key);
+		if (leaf == nullptr) {
+			return 0;
+		}
+
+		std::size_t position = lower_position(leaf, key);
+		if (position == leaf->keys.size() || compare(key, leaf->keys[position])) {
+			return 0;
+		}
+
+		leaf->keys.erase(leaf->keys.begin() + position);
+		leaf->values.erase(leaf->values.begin() + position);
+		--count;
+		rebalance_leaf(leaf);
+		return 1;
+	}
+
+	void clear() noexcept {
+		destroy(root);
+		root = nullptr;
+		first = nullptr;
+		count = 0;
+	}
+
+private:
+	struct Inner;
+
+	struct Node {
+		explicit Node(bool is_leaf) : is_leaf(is_leaf), parent(nullptr) {}
+
+		bool is_leaf;
+		Inner *parent;
+	};
+
+	struct Leaf : Node {
+		Leaf() : Node(true), previous(nullptr), next(nullptr) {
+			keys.reserve(leaf_capacity + 1);
+			values.reserve(leaf_capacity + 1);
+		}
+
+		std::vector<Key> keys;
+		std::vector<Value> values;
+		Leaf *previous;
+		Leaf *next;
+	};
+
+	// Child i holds the keys in [keys[i - 1], keys[i]).
+	struct Inner : Node {
+		Inner() : Node(false) {
+			keys.reserve(inner_capacity);
+			children.reserve(inner_capacity + 1);
+		}
+
+		std::vector<Key> keys;
+		std::vector<Node *> children;
+	};
+
+	// Nodes allocated up front by insert(); whatever is left is freed.
+	struct Spares {
+		Spares() : leaf(nullptr) {}
+
+		~Spares() {
+			delete leaf;
+			for (auto inner : inners) {
+				delete inner;
+			}
+		}
+
+		Inner *take_inner() {
+			Inner *inner = inners.back();
+			inners.pop_back();
+			return inner;
+		}
+
+		Leaf *leaf;
+		std::vector<Inner *> inners;
+	};
+
+	static void destroy(Node *node) noexcept {
+		if (node == nullptr) {
+			return;
+		}
+
+		if (node->is_leaf) {
+			delete static_cast<Leaf *>(node);
+			return;
+		}
+
+		Inner *inner = static_cast<Inner *>(node);
+		for (auto child : inner->children) {
+			destroy(child);
+		}
+		delete inner;
+	}
+
+	std::size_t lower_position(const Leaf *leaf, const Key &key) const {
+		return std::lower_bound(leaf->keys.begin(), leaf->keys.end(), key, compare) - leaf->keys.begin();
+	}
+
+	Leaf *find_leaf(const Key &key) const {
+		Node *node = root;
+		while (node != nullptr && !node->is_leaf) {
+			Inner *inner = static_cast<Inner *>(node);
+			node = inner->children[std::upper_bound(inner->keys.begin(), inner->keys.end(), key, compare)
+				- inner->keys.begin()];
+		}
+		return static_cast<Leaf *>(node);
+	}
+
+	// The first key of the right half once key is inserted at position
+	// into the full leaf.
+	static Key split_key(const Leaf *leaf, std::size_t position, const Key &key) {
+		std::size_t middle = (leaf->keys.size() + 1) / 2;
+		if (position == middle) {
+			return key;
+		}
+		return position < middle ? leaf->keys[middle - 1] : leaf->keys[middle];
+	}
+
+	static std::size_t child_position(const Inner *inner, const Node *child) noexcept {
+		return std::find(inner->children.begin(), inner->children.end(), child) - inner->children.begin();
+	}
+
+	// Hangs right next to left under their parent, splitting inner nodes
+	// upwards with the preallocated spares.
+	void add_child(Node *left, Node *right, Key separator, Spares &spares) noexcept {
+		for (;;) {
+			Inner *parent = left->parent;
+			if (parent == nullptr) {
+				Inner *new_root = spares.take_inner();
+				new_root->keys.push_back(std::move(separator));
+				new_root->children.push_back(left);
+				new_root->children.push_back(right);
+				left->parent = new_root;
+				right->parent = new_root;
+				root = new_root;
+				return;
+			}
+
+			std::size_t position = child_position(parent, left);
+			parent->keys.insert(parent->keys.begin() + position, std::move(separator));
+			parent->children.insert(parent->children.begin() + position + 1, right);
+			right->parent = parent;
+			if (parent->children.size() <= inner_capacity) {
+				return;
+			}
+
+			Inner *sibling = spares.take_inner();
+			std::size_t middle = parent->children.size() / 2;
+			separator = std::move(parent->keys[middle - 1]);
+			std::move(parent->keys.begin() + middle, parent->keys.end(), std::back_inserter(sibling->keys));
+			sibling->children.assign(parent->children.begin() + middle, parent->children.end());
+			parent->keys.erase(parent->keys.begin() + middle - 1, parent->keys.end());
+			parent->children.erase(parent->children.begin() + middle, parent->children.end());
+			for (auto child : sibling->children) {
+				child->parent = sibling;
+			}
+
+			left = parent;
+			right = sibling;
+		}
+	}
+
+	void rebalance_leaf(Leaf *leaf) noexcept {
+		Inner *parent = leaf->parent;
+		if (leaf->keys.empty()) {
+			unlink(leaf);
+			if (parent == nullptr) {
+				root = nullptr;
+			} else {
+				remove_child(parent, child_position(parent, leaf));
+			}
+			delete leaf;
+			return;
+		}
+
+		if (parent == nullptr || leaf->keys.size() >= leaf_capacity / 4) {
+			return;
+		}
+
+		std::size_t position = child_position(parent, leaf);
+		if (position + 1 < parent->children.size()) {
+			merge_leaves(static_cast<Leaf *>(parent->children[position + 1]), position + 1);
+		} else if (position > 0) {
+			merge_leaves(leaf, position);
+		}
+	}
+
+	// Merges the leaf at position into its left neighbour if they fit.
+	void merge_leaves(Leaf *right, std::size_t position) noexcept {
+		Inner *parent = right->parent;
+		Leaf *left = static_cast<Leaf *>(parent->children[position - 1]);
+		if (left->keys.size() + right->keys.size() > leaf_capacity) {
+			return;
+		}
+
+		std::move(right->keys.begin(), right->keys.end(), std::back_inserter(left->keys));
+		std::move(right->values.begin(), right->values.end(), std::back_inserter(left->values));
+		unlink(right);
+		remove_child(parent, position);
+		delete right;
+	}
+
+	void unlink(Leaf *leaf) noexcept {
+		if (leaf->previous != nullptr) {
+			leaf->previous->next = leaf->next;
+		} else {
+			first = leaf->next;
+		}
+		if (leaf->next != nullptr) {
+			leaf->next->previous = leaf->previous;
+		}
+	}
+
+	void remove_child(Inner *inner, std::size_t position) noexcept {
+		inner->children.erase(inner->children.begin() + position);
+		if (!inner->keys.empty()) {
+			inner->keys.erase(inner->keys.begin() + (position == 0 ? 0 : position - 1));
+		}
+
+		Inner *parent = inner->parent;
+		if (parent == nullptr) {
+			if (inner->children.size() == 1) {
+				root = inner->children.front();
+				root->parent = nullptr;
+				inner->children.clear();
+				delete inner;
+			}
+			return;
+		}
+
+		if (inner->children.empty()) {
+			remove_child(parent, child_position(parent, inner));
+			delete inner;
+			return;
+		}
+
+		if (inner->children.size() >= inner_capacity / 4) {
+			return;
+		}
+
+		std::size_t index = child_position(parent, inner);
+		if (index + 1 < parent->children.size()) {
+			merge_inners(static_cast<Inner *>(parent->children[index + 1]), index + 1);
+		} else if (index > 0) {
+			merge_inners(inner, index);
+		}
+	}
+
+	// Merges the inner node at position into its left neighbour if they
+	// fit, pulling the separator between them down.
+	void merge_inners(Inner *right, std::size_t position) noexcept {
+		Inner *parent = right->parent;
+		Inner *left = static_cast<Inner *>(parent->children[position - 1]);
+		if (left->children.size() + right->children.size() > inner_capacity) {
+			return;
+		}
+
+		left->keys.push_back(std::move(parent->keys[position - 1]));
+		std::move(right->keys.begin(), right->keys.end(), std::back_inserter(left->keys));
+		for (auto child : right->children) {
+			child->parent = left;
+			left->children.push_back(child);
+		}
+		right->children.clear();
+		remove_child(parent, position);
+		delete right;
+	}
+
+	Node *root;
+
+	Leaf *first;
+
+	std::size_t count;
+
+	Compare compare;
+};
+
+#endif
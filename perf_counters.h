@@ -0,0 +1,175 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <ostream>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware counters for benchmarking VirusGenealogy operations. Each
+// counter is opened on its own through perf_event_open, so a counter the
+// CPU, the kernel or perf_event_paranoid refuses is just reported as
+// unavailable while the others and the wall-clock numbers still work. On
+// other systems every counter is unavailable.
+class PerfCounters {
+public:
+	enum Counter {
+		cycles,
+		instructions,
+		llc_misses,
+		branch_misses,
+		counter_count
+	};
+
+	struct Reading {
+		double seconds;
+		double operations_per_second;
+		double per_operation[counter_count];
+		bool valid[counter_count];
+	};
+
+	PerfCounters(const PerfCounters &) = delete;
+
+	PerfCounters &operator=(const PerfCounters &) = delete;
+
+	PerfCounters() {
+		for (int counter = 0; counter < counter_count; ++counter) {
+			descriptors[counter] = open(static_cast<Counter>(counter));
+		}
+	}
+
+	~PerfCounters() {
+#if defined(__linux__)
+		for (int counter = 0; counter < counter_count; ++counter) {
+			if (descriptors[counter] >= 0) {
+				close(descriptors[counter]);
+			}
+		}
+#endif
+	}
+
+	bool available(Counter counter) const noexcept {
+		return descriptors[counter] >= 0;
+	}
+
+	static const char *name(Counter counter) noexcept {
+		static const char *const names[counter_count] = {
+			"cycles", "instructions", "llc-misses", "branch-misses"
+		};
+		return names[counter];
+	}
+
+	// Runs f, which performs the given number of operations, and reports
+	// wall time, throughput and each available counter per operation.
+	template<class Function>
+	Reading measure(std::size_t operations, Function f) {
+		Reading reading;
+		std::uint64_t values[counter_count];
+
+		control(reset_request);
+		control(enable_request);
+		auto start = std::chrono::steady_clock::now();
+		f();
+		auto stop = std::chrono::steady_clock::now();
+		control(disable_request);
+
+		reading.seconds = std::chrono::duration<double>(stop - start).count();
+		reading.operations_per_second = reading.seconds > 0 ? operations / reading.seconds : 0;
+		for (int counter = 0; counter < counter_count; ++counter) {
+			reading.valid[counter] = read(counter, values[counter]);
+			reading.per_operation[counter] = reading.valid[counter] && operations > 0
+				? static_cast<double>(values[counter]) / operations : 0;
+		}
+		return reading;
+	}
+
+	static void print(std::ostream &out, const char *label, const Reading &reading) {
+		out << label << ": " << reading.operations_per_second << " ops/s";
+		for (int counter = 0; counter < counter_count; ++counter) {
+			out << ", " << name(static_cast<Counter>(counter)) << "/op ";
+			if (reading.valid[counter]) {
+				out << reading.per_operation[counter];
+			} else {
+				out << "n/a";
+			}
+		}
+		out << '\n';
+	}
+
+private:
+#if defined(__linux__)
+	static constexpr unsigned long reset_request = PERF_EVENT_IOC_RESET;
+	static constexpr unsigned long enable_request = PERF_EVENT_IOC_ENABLE;
+	static constexpr unsigned long disable_request = PERF_EVENT_IOC_DISABLE;
+
+	static int open(Counter counter) noexcept {
+		static const std::uint64_t configs[counter_count] = {
+			PERF_COUNT_HW_CPU_CYCLES,
+			PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_CACHE_MISSES,
+			PERF_COUNT_HW_BRANCH_MISSES
+		};
+
+		perf_event_attr attributes;
+		std::memset(&attributes, 0, sizeof(attributes));
+		attributes.size = sizeof(attributes);
+		attributes.type = PERF_TYPE_HARDWARE;
+		attributes.config = configs[counter];
+		attributes.disabled = 1;
+		attributes.exclude_kernel = 1;
+		attributes.exclude_hv = 1;
+		attributes.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		long descriptor = syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+		return descriptor < 0 ? -1 : static_cast<int>(descriptor);
+	}
+
+	void control(unsigned long request) noexcept {
+		for (int counter = 0; counter < counter_count; ++counter) {
+			if (descriptors[counter] >= 0) {
+				ioctl(descriptors[counter], request, 0);
+			}
+		}
+	}
+
+	// Scales the count up when the kernel had to multiplex the counter.
+	bool read(int counter, std::uint64_t &value) const noexcept {
+		std::uint64_t data[3];
+		if (descriptors[counter] < 0
+			|| ::read(descriptors[counter], data, sizeof(data)) != sizeof(data)
+			|| data[2] == 0) {
+			return false;
+		}
+		value = data[2] == data[1] ? data[0]
+			: static_cast<std::uint64_t>(static_cast<double>(data[0]) * data[1] / data[2]);
+		return true;
+	}
+#else
+	static constexpr unsigned long reset_request = 0;
+	static constexpr unsigned long enable_request = 0;
+	static constexpr unsigned long disable_request = 0;
+
+	static int open(Counter) noexcept {
+		return -1;
+	}
+
+	void control(unsigned long) noexcept {
+	}
+
+	bool read(int, std::uint64_t &) const noexcept {
+		return false;
+	}
+#endif
+
+	int descriptors[counter_count];
+};
+
+#endif
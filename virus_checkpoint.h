@@ -0,0 +1,348 @@
+#ifndef VIRUS_CHECKPOINT_H
+#define VIRUS_CHECKPOINT_H
+
+#include "virus_genealogy.h"
+#include "virus_ingest.h"
+
+#include <vector>
+#include <map>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <utility>
+#include <thread>
+#include <exception>
+#include <cstdio>
+#include <cstddef>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+class CheckpointError : public std::exception {
+	virtual const char *what() const throw() {
+		return "CheckpointError";
+	}
+};
+
+// Keeps a VirusGenealogy recoverable from a base snapshot and a series of
+// small delta files, all in the ingestion format:
+//
+//   <prefix>.base       "# checkpoint <n>" followed by create records
+//   <prefix>.delta.<k>  the changes made after delta k - 1
+//
+// A base with header n already contains deltas 1 to n. Changes go through
+// this class, which applies them to the genealogy and then appends them to
+// the current delta; checkpoint() makes the delta durable and starts the
+// next one. compact() folds the base and the finished deltas into a new
+// base on a background thread. It works from the files alone, so readers
+// and writers of the live genealogy carry on meanwhile.
+//
+// Durable means fsync()ed, the file and then its directory, so that a
+// new file or a rename survives too. Without POSIX the files are only
+// flushed to the operating system, which a power loss can undo. Bases are
+// written aside and renamed into place; a delta may end in a record torn
+// by a crash, which replay drops.
+template<class Virus>
+class CheckpointedGenealogy {
+public:
+	typedef VirusGenealogy<Virus> genealogy_type;
+	typedef typename Virus::id_type id_type;
+	typedef IngestRecord<id_type> record_type;
+
+	CheckpointedGenealogy(const CheckpointedGenealogy &) = delete;
+
+	CheckpointedGenealogy &operator=(const CheckpointedGenealogy &) = delete;
+
+	// Starts logging the changes of genealogy. If there is no base under
+	// prefix yet, a full snapshot of genealogy becomes the base; otherwise
+	// genealogy must hold what the files describe, e.g. after restore().
+	CheckpointedGenealogy(genealogy_type &genealogy, const std::string &prefix)
+		: live(genealogy), prefix(prefix) {
+		std::ifstream base(base_path(prefix));
+		if (base) {
+			delta_number = last_delta(prefix, read_header(base)) + 1;
+		} else {
+			// Written aside and renamed, so that a crash cannot leave a
+			// partial base behind to be taken for a complete one.
+			std::string temporary = base_path(prefix) + ".tmp";
+			write_snapshot(live, temporary, 0);
+			if (std::rename(temporary.c_str(), base_path(prefix).c_str()) != 0) {
+				throw CheckpointError();
+			}
+			sync_directory(prefix);
+			delta_number = 1;
+		}
+		open_delta();
+	}
+
+	~CheckpointedGenealogy() {
+		delta.flush();
+		if (compaction.joinable()) {
+			compaction.join();
+		}
+	}
+
+	// Replays the base and every delta under prefix into genealogy, which
+	// must be freshly constructed with the same stem.
+	static void restore(genealogy_type &genealogy, const std::string &prefix) {
+		replay(genealogy, prefix, static_cast<std::size_t>(-1));
+	}
+
+	const genealogy_type &genealogy() const noexcept {
+		return live;
+	}
+
+	void create(const id_type& id, const id_type& parent_id) {
+		live.create(id, parent_id);
+		log(record_type::create, {id, parent_id});
+	}
+
+	void create(const id_type& id, const std::vector<id_type>& parent_ids) {
+		live.create(id, parent_ids);
+		std::vector<id_type> ids(1, id);
+		ids.insert(ids.end(), parent_ids.begin(), parent_ids.end());
+		log(record_type::create, std::move(ids));
+	}
+
+	void connect(const id_type& child_id, const id_type& parent_id) {
+		live.connect(child_id, parent_id);
+		log(record_type::connect, {child_id, parent_id});
+	}
+
+	void connect_batch(const std::vector<std::pair<id_type, id_type>>& edges) {
+		live.connect_batch(edges);
+		for (auto &edge : edges) {
+			log(record_type::connect, {edge.first, edge.second});
+		}
+	}
+
+	void remove(const id_type& id) {
+		live.remove(id);
+		log(record_type::remove, {id});
+	}
+
+	// Makes the current delta durable and starts the next one. Changes
+	// made before a checkpoint survive a crash; later ones may not.
+	void checkpoint() {
+		delta.close();
+		if (!delta) {
+			throw CheckpointError();
+		}
+		sync_file(delta_path(prefix, delta_number));
+		sync_directory(prefix);
+		++delta_number;
+		open_delta();
+	}
+
+	// Checkpoints and then, on a background thread, replays the base and
+	// all deltas into a scratch genealogy, writes it out as the new base
+	// and deletes the deltas it covers. A previous compaction is waited
+	// for first.
+	void compact() {
+		wait_for_compaction();
+		checkpoint();
+
+		std::size_t through = delta_number - 1;
+		id_type stem_id = live.get_stem_id();
+		std::string files = prefix;
+		compaction = std::thread([this, through, stem_id, files] {
+			try {
+				genealogy_type merged(stem_id);
+				std::size_t old_through = replay(merged, files, through);
+				std::string temporary = base_path(files) + ".tmp";
+				write_snapshot(merged, temporary, through);
+				if (std::rename(temporary.c_str(), base_path(files).c_str()) != 0) {
+					throw CheckpointError();
+				}
+				// The deltas go only once the new base is sure to be found.
+				sync_directory(files);
+				for (std::size_t number = old_through + 1; number <= through; ++number) {
+					std::remove(delta_path(files, number).c_str());
+				}
+			} catch (...) {
+				compaction_error = std::current_exception();
+			}
+		});
+	}
+
+	// Waits for the running compaction, if any, and rethrows its error.
+	void wait_for_compaction() {
+		if (compaction.joinable()) {
+			compaction.join();
+		}
+
+		std::exception_ptr error = compaction_error;
+		compaction_error = nullptr;
+		if (error) {
+			std::rethrow_exception(error);
+		}
+	}
+
+private:
+	static std::string base_path(const std::string &prefix) {
+		return prefix + ".base";
+	}
+
+	static std::string delta_path(const std::string &prefix, std::size_t number) {
+		return prefix + ".delta." + std::to_string(number);
+	}
+
+	static std::size_t read_header(std::istream &base) {
+		std::string line;
+		std::string comment;
+		std::string keyword;
+		std::size_t through;
+		std::getline(base, line);
+		std::istringstream fields(line);
+		if (!(fields >> comment >> keyword >> through) || comment != "#" || keyword != "checkpoint") {
+			throw CheckpointError();
+		}
+		return through;
+	}
+
+	static std::size_t last_delta(const std::string &prefix, std::size_t number) {
+		while (std::ifstream(delta_path(prefix, number + 1))) {
+			++number;
+		}
+		return number;
+	}
+
+	// Replays the base and the deltas after it up to through, and returns
+	// the number in the header of the base.
+	static std::size_t replay(genealogy_type &genealogy, const std::string &prefix, std::size_t through) {
+		std::ifstream base(base_path(prefix));
+		if (!base) {
+			throw CheckpointError();
+		}
+
+		std::size_t base_through = read_header(base);
+		IngestPipeline<genealogy_type>(genealogy).run(base);
+		for (std::size_t number = base_through + 1; number <= through; ++number) {
+			std::ifstream delta(delta_path(prefix, number));
+			if (!delta) {
+				if (through == static_cast<std::size_t>(-1)) {
+					break;
+				}
+				throw CheckpointError();
+			}
+			std::istringstream records(complete_records(delta));
+			IngestPipeline<genealogy_type>(genealogy).run(records);
+		}
+		return base_through;
+	}
+
+	// The contents of a delta up to its last newline. A crash while a
+	// record was appended can leave it torn at the end, where it may still
+	// parse, e.g. "create 12 3" from "create 12 34"; it was never part of
+	// a checkpoint, so it is dropped.
+	static std::string complete_records(std::istream &delta) {
+		std::ostringstream contents;
+		contents << delta.rdbuf();
+		std::string records = contents.str();
+		std::size_t end = records.rfind('\n');
+		records.erase(end == std::string::npos ? 0 : end + 1);
+		return records;
+	}
+
+	// Writes every virus but the stem as a create record with all of its
+	// parents, each after all of its parents.
+	static void write_snapshot(const genealogy_type &genealogy, const std::string &path, std::size_t through) {
+		std::ofstream out(path, std::ios::trunc);
+		out << "# checkpoint " << through << '\n';
+
+		std::map<id_type, std::size_t> unwritten_parents;
+		std::vector<id_type> written(1, genealogy.get_stem_id());
+		record_type record;
+		record.kind = record_type::create;
+		while (!written.empty()) {
+			id_type id = written.back();
+			written.pop_back();
+			for (auto &child : genealogy.children_view(id)) {
+				auto it = unwritten_parents.find(child);
+				if (it == unwritten_parents.end()) {
+					it = unwritten_parents.emplace(child, genealogy.parents_view(child).size()).first;
+				}
+				if (--it->second != 0) {
+					continue;
+				}
+
+				unwritten_parents.erase(it);
+				auto parents = genealogy.parents_view(child);
+				record.ids.assign(1, child);
+				record.ids.insert(record.ids.end(), parents.begin(), parents.end());
+				record.write(out);
+				written.push_back(child);
+			}
+		}
+
+		out.close();
+		if (!out) {
+			throw CheckpointError();
+		}
+		sync_file(path);
+	}
+
+	static void sync_file(const std::string &path) {
+		sync_path(path, false);
+	}
+
+	// Syncs the directory holding the files under prefix, which records
+	// their creation and renames.
+	static void sync_directory(const std::string &prefix) {
+		std::size_t slash = prefix.rfind('/');
+		std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : prefix.substr(0, slash);
+		sync_path(directory, true);
+	}
+
+#if defined(__unix__) || defined(__APPLE__)
+	static void sync_path(const std::string &path, bool directory) {
+		int descriptor = ::open(path.c_str(), directory ? O_RDONLY | O_DIRECTORY : O_RDONLY);
+		if (descriptor < 0) {
+			throw CheckpointError();
+		}
+		bool synced = ::fsync(descriptor) == 0;
+		::close(descriptor);
+		if (!synced) {
+			throw CheckpointError();
+		}
+	}
+#else
+	static void sync_path(const std::string &, bool) {}
+#endif
+
+	void open_delta() {
+		delta.clear();
+		delta.open(delta_path(prefix, delta_number), std::ios::trunc);
+		if (!delta) {
+			throw CheckpointError();
+		}
+	}
+
+	// The change is already applied; CheckpointError only reports that the
+	// delta could not record it.
+	void log(typename record_type::Kind kind, std::vector<id_type> ids) {
+		record_type record;
+		record.kind = kind;
+		record.ids = std::move(ids);
+		record.write(delta);
+		if (!delta) {
+			throw CheckpointError();
+		}
+	}
+
+	genealogy_type &live;
+
+	const std::string prefix;
+
+	std::size_t delta_number;
+
+	std::ofstream delta;
+
+	std::thread compaction;
+
+	std::exception_ptr compaction_error;
+};
+
+#endif
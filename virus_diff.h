@@ -0,0 +1,187 @@
+#ifndef VIRUS_DIFF_H
+#define VIRUS_DIFF_H
+
+#include "virus_genealogy.h"
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <iterator>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <exception>
+#include <cstddef>
+
+// What changed from one genealogy to another. Edges are (child_id,
+// parent_id) pairs, the argument order of connect(), and an edge is listed
+// when either end is added or removed. Everything is sorted by id, edges
+// by child and then by parent.
+template<class id_type>
+struct GenealogyDiff {
+	std::vector<id_type> added_viruses;
+	std::vector<id_type> removed_viruses;
+	std::vector<std::pair<id_type, id_type>> added_edges;
+	std::vector<std::pair<id_type, id_type>> removed_edges;
+
+	bool empty() const noexcept {
+		return added_viruses.empty() && removed_viruses.empty()
+			&& added_edges.empty() && removed_edges.empty();
+	}
+};
+
+// Walks the ids of both genealogies in order from the given positions up
+// to the given ends, comparing the sorted parent lists of viruses present
+// in both, and appends the differences to result.
+template<class Virus>
+void diff_range(const VirusGenealogy<Virus> &from, const VirusGenealogy<Virus> &to,
+		typename VirusGenealogy<Virus>::IdRange::const_iterator from_it,
+		typename VirusGenealogy<Virus>::IdRange::const_iterator from_end,
+		typename VirusGenealogy<Virus>::IdRange::const_iterator to_it,
+		typename VirusGenealogy<Virus>::IdRange::const_iterator to_end,
+		GenealogyDiff<typename Virus::id_type> &result) {
+	typedef typename Virus::id_type id_type;
+	std::vector<id_type> from_parents;
+	std::vector<id_type> to_parents;
+
+	auto sorted_parents = [](const VirusGenealogy<Virus> &genealogy, const id_type &id,
+			std::vector<id_type> &parents) {
+		auto view = genealogy.parents_view(id);
+		parents.assign(view.begin(), view.end());
+		std::sort(parents.begin(), parents.end());
+	};
+	auto add_edges = [](const id_type &child, const std::vector<id_type> &parents,
+			std::vector<std::pair<id_type, id_type>> &edges) {
+		for (auto &parent : parents) {
+			edges.emplace_back(child, parent);
+		}
+	};
+
+	while (from_it != from_end || to_it != to_end) {
+		if (to_it == to_end || (from_it != from_end && *from_it < *to_it)) {
+			result.removed_viruses.push_back(*from_it);
+			sorted_parents(from, *from_it, from_parents);
+			add_edges(*from_it, from_parents, result.removed_edges);
+			++from_it;
+			continue;
+		}
+
+		if (from_it == from_end || *to_it < *from_it) {
+			result.added_viruses.push_back(*to_it);
+			sorted_parents(to, *to_it, to_parents);
+			add_edges(*to_it, to_parents, result.added_edges);
+			++to_it;
+			continue;
+		}
+
+		sorted_parents(from, *from_it, from_parents);
+		sorted_parents(to, *to_it, to_parents);
+		auto old_parent = from_parents.begin();
+		auto new_parent = to_parents.begin();
+		while (old_parent != from_parents.end() || new_parent != to_parents.end()) {
+			if (new_parent == to_parents.end() || (old_parent != from_parents.end() && *old_parent < *new_parent)) {
+				result.removed_edges.emplace_back(*from_it, *old_parent++);
+			} else if (old_parent == from_parents.end() || *new_parent < *old_parent) {
+				result.added_edges.emplace_back(*to_it, *new_parent++);
+			} else {
+				++old_parent;
+				++new_parent;
+			}
+		}
+		++from_it;
+		++to_it;
+	}
+}
+
+template<class Virus>
+GenealogyDiff<typename Virus::id_type> diff(const VirusGenealogy<Virus> &from, const VirusGenealogy<Virus> &to) {
+	GenealogyDiff<typename Virus::id_type> result;
+	auto from_ids = from.id_range();
+	auto to_ids = to.id_range();
+	diff_range(from, to, from_ids.begin(), from_ids.end(), to_ids.begin(), to_ids.end(), result);
+	return result;
+}
+
+// Like diff(), with the id space cut into chunks of about grain viruses of
+// from that are compared on separate threads and concatenated in order.
+// Finding the cuts is a plain walk over the ids of both genealogies; the
+// parent lookups and comparisons, which dominate, run in parallel.
+template<class Virus>
+GenealogyDiff<typename Virus::id_type> parallel_diff(const VirusGenealogy<Virus> &from,
+		const VirusGenealogy<Virus> &to, std::size_t grain = 4096) {
+	typedef typename Virus::id_type id_type;
+	typedef typename VirusGenealogy<Virus>::IdRange::const_iterator id_iterator;
+
+	auto from_ids = from.id_range();
+	auto to_ids = to.id_range();
+	std::vector<std::pair<id_iterator, id_iterator>> starts(1, std::make_pair(from_ids.begin(), to_ids.begin()));
+	id_iterator to_it = to_ids.begin();
+	std::size_t count = 0;
+	for (auto from_it = from_ids.begin(); from_it != from_ids.end(); ++from_it) {
+		if (++count % std::max<std::size_t>(grain, 1) != 0) {
+			continue;
+		}
+		while (to_it != to_ids.end() && *to_it < *from_it) {
+			++to_it;
+		}
+		starts.emplace_back(from_it, to_it);
+	}
+	starts.emplace_back(from_ids.end(), to_ids.end());
+
+	std::size_t chunks = starts.size() - 1;
+	std::vector<GenealogyDiff<id_type>> parts(chunks);
+	std::atomic<std::size_t> next_chunk(0);
+	std::exception_ptr error;
+	std::mutex error_mutex;
+	auto work = [&] {
+		try {
+			for (std::size_t chunk; (chunk = next_chunk++) < chunks;) {
+				diff_range(from, to, starts[chunk].first, starts[chunk + 1].first,
+					starts[chunk].second, starts[chunk + 1].second, parts[chunk]);
+			}
+		} catch (...) {
+			std::lock_guard<std::mutex> lock(error_mutex);
+			if (!error) {
+				error = std::current_exception();
+			}
+			next_chunk = chunks;
+		}
+	};
+
+	std::size_t workers = std::min<std::size_t>(std::thread::hardware_concurrency(), chunks);
+	std::vector<std::thread> threads;
+	threads.reserve(workers);
+	try {
+		for (std::size_t worker = 1; worker < workers; ++worker) {
+			threads.emplace_back(work);
+		}
+	} catch (...) {
+		next_chunk = chunks;
+		for (auto &thread : threads) {
+			thread.join();
+		}
+		throw;
+	}
+	work();
+	for (auto &thread : threads) {
+		thread.join();
+	}
+	if (error) {
+		std::rethrow_exception(error);
+	}
+
+	GenealogyDiff<id_type> result;
+	for (auto &part : parts) {
+		auto move_all = [](auto &source, auto &target) {
+			target.insert(target.end(), std::make_move_iterator(source.begin()),
+				std::make_move_iterator(source.end()));
+		};
+		move_all(part.added_viruses, result.added_viruses);
+		move_all(part.removed_viruses, result.removed_viruses);
+		move_all(part.added_edges, result.added_edges);
+		move_all(part.removed_edges, result.removed_edges);
+	}
+	return result;
+}
+
+#endif
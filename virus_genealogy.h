@@ -1,12 +1,32 @@
 #ifndef VIRUS_GENEALOGY_H
 #define VIRUS_GENEALOGY_H
 
+#include "id_index.h"
+#include "virus_payload_store.h"
+
 #include <vector>
 #include <queue>
 #include <map>
 #include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <memory>
 #include <algorithm>
+#include <utility>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+#include <bitset>
+#include <optional>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <exception>
+#include <string>
 
 class VirusNotFound : public std::exception {
 	virtual const char *what() const throw() {
@@ -26,8 +46,25 @@ class TriedToRemoveStemVirus : public std::exception {
 	}
 };
 
+class TriedToCreateCycle : public std::exception {
+	virtual const char *what() const throw() {
+		return "TriedToCreateCycle";
+	}
+};
+
+class TriedToConnectStemVirus : public std::exception {
+	virtual const char *what() const throw() {
+		return "TriedToConnectStemVirus";
+	}
+};
+
+template<class Virus>
+class VirusForest;
+
 template<class Virus>
 class VirusGenealogy {
+	friend class VirusForest<Virus>;
+
 public:
 	typedef typename Virus::id_type id_type;
 
@@ -38,182 +75,3184 @@ public:
 	VirusGenealogy &operator=(const VirusGenealogy &) = delete;
 
 	VirusGenealogy(const id_type& stem_id) : stem_id(stem_id) {
-		viruses[stem_id] = std::make_shared<VirusNode>(stem_id);
+		add_stem(stem_id);
 	}
 
 	id_type get_stem_id() const noexcept {
 		return stem_id;
 	}
 
+	// Refers to a virus by its slot in the node storage, so operations given
+	// a handle skip the id lookup. Every slot carries a generation that
+	// changes when the slot is reused, so a handle to a removed virus is
+	// rejected with VirusNotFound instead of reaching its successor.
+	// reorder() moves every virus and invalidates all handles.
+	class Handle {
+	public:
+		Handle() : index(no_node), generation(0) {}
+
+		bool operator==(const Handle &other) const {
+			return index == other.index && generation == other.generation;
+		}
+
+		bool operator!=(const Handle &other) const {
+			return !(*this == other);
+		}
+
+	private:
+		friend class VirusGenealogy;
+
+		std::size_t index;
+		std::size_t generation;
+	};
+
+	Handle handle(const id_type& id) const {
+		return handle_of(get_node(id));
+	}
+
 	std::vector<id_type> get_children(const id_type& id) const {
-		if (!exists(id)) {
-			throw VirusNotFound();
+		return ids_of(nodes[get_node(id)].children);
+	}
+
+	std::vector<id_type> get_children(const Handle& handle) const {
+		return ids_of(nodes[get_node(handle)].children);
+	}
+
+	std::vector<id_type> get_parents(id_type const &id) const {
+		return ids_of(nodes[get_node(id)].parents);
+	}
+
+	std::vector<id_type> get_parents(const Handle& handle) const {
+		return ids_of(nodes[get_node(handle)].parents);
+	}
+
+	// A read-only range over the ids of the children or parents of a virus.
+	// It does not allocate, and it is invalidated by any modification of
+	// the genealogy.
+	class IdView {
+	public:
+		class const_iterator {
+		public:
+			typedef std::forward_iterator_tag iterator_category;
+			typedef typename VirusGenealogy::id_type value_type;
+			typedef std::ptrdiff_t difference_type;
+			typedef const value_type *pointer;
+			typedef const value_type &reference;
+
+			const_iterator() : genealogy(nullptr), position(nullptr) {}
+
+			reference operator*() const {
+				return genealogy->nodes[*position].id;
+			}
+
+			pointer operator->() const {
+				return &**this;
+			}
+
+			const_iterator &operator++() {
+				++position;
+				return *this;
+			}
+
+			const_iterator operator++(int) {
+				const_iterator previous = *this;
+				++position;
+				return previous;
+			}
+
+			bool operator==(const const_iterator &other) const {
+				return position == other.position;
+			}
+
+			bool operator!=(const const_iterator &other) const {
+				return position != other.position;
+			}
+
+		private:
+			friend class IdView;
+
+			const_iterator(const VirusGenealogy *genealogy, const std::size_t *position)
+				: genealogy(genealogy), position(position) {}
+
+			const VirusGenealogy *genealogy;
+			const std::size_t *position;
+		};
+
+		const_iterator begin() const {
+			return const_iterator(genealogy, first);
+		}
+
+		const_iterator end() const {
+			return const_iterator(genealogy, last);
 		}
 
-		auto children = viruses.find(id)->second->children;
-		std::vector<id_type> children_vector;
+		std::size_t size() const {
+			return last - first;
+		}
 
-		for (auto child : children) {
-			children_vector.push_back(child.get()->id);
+		bool empty() const {
+			return first == last;
 		}
 
-		return children_vector;
+	private:
+		friend class VirusGenealogy;
+
+		IdView(const VirusGenealogy *genealogy, const std::vector<std::size_t> &indices)
+			: genealogy(genealogy), first(indices.data()), last(indices.data() + indices.size()) {}
+
+		const VirusGenealogy *genealogy;
+		const std::size_t *first;
+		const std::size_t *last;
+	};
+
+	IdView children_view(const id_type& id) const {
+		return IdView(this, nodes[get_node(id)].children);
 	}
 
-	std::vector<id_type> get_parents(id_type const &id) const {
-		if (!exists(id)) {
-			throw VirusNotFound();
+	IdView children_view(const Handle& handle) const {
+		return IdView(this, nodes[get_node(handle)].children);
+	}
+
+	IdView parents_view(const id_type& id) const {
+		return IdView(this, nodes[get_node(id)].parents);
+	}
+
+	IdView parents_view(const Handle& handle) const {
+		return IdView(this, nodes[get_node(handle)].parents);
+	}
+
+	// The ids in [lo, hi) in increasing order, read from the leaves of the
+	// id index. It does not allocate, and it is invalidated by any
+	// modification of the genealogy.
+	class IdRange {
+	public:
+		typedef typename IdIndex<id_type, std::size_t>::const_iterator const_iterator;
+
+		const_iterator begin() const {
+			return first;
 		}
 
-		auto parents = viruses.find(id)->second->parents;
-		std::vector<id_type> parents_vector;
+		const_iterator end() const {
+			return last;
+		}
 
-		for (auto parent : parents) {
-			parents_vector.push_back(parent.get()->id);
+		bool empty() const {
+			return first == last;
 		}
 
-		return parents_vector;
+	private:
+		friend class VirusGenealogy;
+
+		IdRange(const_iterator first, const_iterator last) : first(first), last(last) {}
+
+		const_iterator first;
+		const_iterator last;
+	};
+
+	IdRange id_range(const id_type& lo, const id_type& hi) const {
+		auto first = viruses.lower_bound(lo);
+		return IdRange(first, lo < hi ? viruses.lower_bound(hi) : first);
+	}
+
+	IdRange id_range() const {
+		return IdRange(viruses.begin(), viruses.end());
 	}
 
 	bool exists(const id_type& id) const noexcept {
 		return viruses.find(id) != viruses.end();
 	}
 
+	bool exists(const Handle& handle) const noexcept {
+		return handle.index < nodes.size() && nodes[handle.index].alive
+			&& nodes[handle.index].generation == handle.generation;
+	}
+
+	// With the payload store enabled, a stored payload is read into its
+	// node and stays there until the virus is removed, so the reference
+	// lives as long as the virus; payload() reads within the cache bound.
 	const Virus &operator[](const id_type& id) const {
-		if (!exists(id)) {
-			throw VirusNotFound();
+		return payload_of(get_node(id));
+	}
+
+	const Virus &operator[](const Handle& handle) const {
+		return payload_of(get_node(handle));
+	}
+
+	// Like operator[], but with the payload store enabled a stored payload
+	// goes through its bounded cache instead of staying in memory for good,
+	// and the pointer keeps it alive after eviction.
+	std::shared_ptr<const Virus> payload(const id_type& id) const {
+		return shared_payload(get_node(id));
+	}
+
+	std::shared_ptr<const Virus> payload(const Handle& handle) const {
+		return shared_payload(get_node(handle));
+	}
+
+	Handle create(const id_type& id, const id_type& parent_id) {
+		if (exists(id)) {
+			throw VirusAlreadyCreated();
 		}
 
-		auto virus_node = viruses.find(id)->second;
-		//auto &virus_ref = *(virus.get());
-		return virus_node.get()->virus;
+		return add_node(id, std::vector<node_index>(1, get_node(parent_id)));
 	}
 
-	void create(const id_type& id, const id_type& parent_id) {
+	Handle create(const id_type& id, const Handle& parent) {
 		if (exists(id)) {
 			throw VirusAlreadyCreated();
 		}
 
-		if (!exists(parent_id)) {
+		return add_node(id, std::vector<node_index>(1, get_node(parent)));
+	}
+
+	Handle create(const id_type& id, const std::vector<id_type>& parent_ids) {
+		return create_from(id, parent_ids);
+	}
+
+	Handle create(const id_type& id, const std::vector<Handle>& parents) {
+		return create_from(id, parents);
+	}
+
+	// The genealogy stays acyclic: an edge from a virus to itself or to one
+	// of its descendants throws TriedToCreateCycle and changes nothing.
+	// Stems keep no parents, so in a VirusForest an edge to another stem
+	// throws TriedToConnectStemVirus and changes nothing either.
+	void connect(const id_type& child_id, const id_type& parent_id) {
+		if (!exists(parent_id) || !exists(child_id)) {
 			throw VirusNotFound();
 		}
 
-		auto new_virus_ptr = std::make_shared<VirusNode>(id);
-		auto parent_node_ptr = viruses.find(parent_id)->second;
-		new_virus_ptr->add_parent(parent_node_ptr);
-		parent_node_ptr->add_child(new_virus_ptr);
-		viruses[id] = new_virus_ptr;
+		connect_nodes(get_node(child_id), get_node(parent_id));
 	}
 
-	void create(const id_type& id, const std::vector<id_type>& parent_ids) {
-		if (exists(id)) {
-			throw VirusAlreadyCreated();
+	void connect(const Handle& child, const Handle& parent) {
+		if (!exists(parent) || !exists(child)) {
+			throw VirusNotFound();
 		}
 
-		if (parent_ids.empty()) {
-			throw VirusNotFound();
-		} else {
-			for (auto parent_id: parent_ids) {
-				if (!exists(parent_id)) {
-					throw VirusNotFound();
+		connect_nodes(child.index, parent.index);
+	}
+
+	// Adds every (child_id, parent_id) edge as connect() would, all or
+	// nothing: if any id is missing nothing is connected. Repeated and
+	// already existing edges are skipped, the adjacency of each touched
+	// virus is rebuilt once and dominators are repaired in a single pass.
+	// If the edges together would close a cycle, TriedToCreateCycle is
+	// thrown and nothing is connected.
+	void connect_batch(const std::vector<std::pair<id_type, id_type>>& edges) {
+		connect_edges(edges);
+	}
+
+	void connect_batch(const std::vector<std::pair<Handle, Handle>>& edges) {
+		connect_edges(edges);
+	}
+
+	void remove(const id_type& id) {
+		remove_node(get_node(id));
+	}
+
+	void remove(const Handle& handle) {
+		remove_node(get_node(handle));
+	}
+
+	// Lists the viruses remove(id) would delete, id included, without
+	// modifying the genealogy. The cost is proportional to the cascade and
+	// the edges leaving it, not to the size of the genealogy.
+	std::vector<id_type> preview_remove(const id_type& id) const {
+		return preview_cascade(get_node(id));
+	}
+
+	std::vector<id_type> preview_remove(const Handle& handle) const {
+		return preview_cascade(get_node(handle));
+	}
+
+	// Counts the viruses remove(id) would delete, id included.
+	std::size_t preview_remove_count(const id_type& id) const {
+		return preview_cascade_count(get_node(id));
+	}
+
+	std::size_t preview_remove_count(const Handle& handle) const {
+		return preview_cascade_count(get_node(handle));
+	}
+
+	// Returns the immediate dominator of id: the closest virus that every
+	// lineage from the stem to id passes through. A virus that no single
+	// strain dominates, like the stem, is its own dominator.
+	id_type get_dominator(const id_type& id) const {
+		return dominator_of(get_node(id));
+	}
+
+	id_type get_dominator(const Handle& handle) const {
+		return dominator_of(get_node(handle));
+	}
+
+	// Checks whether every lineage from the stem to id passes through
+	// dominator_id, i.e. whether remove(dominator_id) would also remove id.
+	bool dominates(const id_type& dominator_id, const id_type& id) const {
+		return dominates_node(get_node(dominator_id), get_node(id));
+	}
+
+	bool dominates(const Handle& dominator, const Handle& handle) const {
+		return dominates_node(get_node(dominator), get_node(handle));
+	}
+
+	// Renumbers the node storage in breadth-first order from the stems and
+	// drops the slots freed by remove(), so that walks down the genealogy
+	// touch neighbouring nodes instead of jumping around in memory.
+	void reorder() {
+		std::vector<node_index> order;
+		order.reserve(viruses.size());
+		std::vector<node_index> new_index(nodes.size(), no_node);
+
+		for (auto stem : stems) {
+			new_index[stem] = order.size();
+			order.push_back(stem);
+		}
+		for (std::size_t i = 0; i < order.size(); ++i) {
+			for (auto child : nodes[order[i]].children) {
+				if (new_index[child] == no_node) {
+					new_index[child] = order.size();
+					order.push_back(child);
 				}
 			}
 		}
 
-		auto new_virus_ptr = std::make_shared<VirusNode>(id);
-		for (auto parent_id : parent_ids) {
-			auto parent_node_ptr = viruses.find(parent_id)->second;
-			new_virus_ptr->add_parent(parent_node_ptr);
-			parent_node_ptr->add_child(new_virus_ptr);
+		for (auto it = viruses.begin(); it != viruses.end(); ++it) {
+			if (new_index[it.value()] == no_node) {
+				new_index[it.value()] = order.size();
+				order.push_back(it.value());
+			}
+		}
+
+		std::vector<VirusNode> reordered;
+		reordered.reserve(order.size());
+		for (auto old_index : order) {
+			const VirusNode &node = nodes[old_index];
+			reordered.emplace_back(node.id, nullptr);
+			reordered.back().children = renumbered(node.children, new_index);
+			reordered.back().parents = renumbered(node.parents, new_index);
+			reordered.back().idom = node.idom == no_node ? no_node : new_index[node.idom];
+			reordered.back().dom_depth = node.dom_depth;
+			reordered.back().rank = node.rank;
+			reordered.back().stem = node.stem;
+			reordered.back().payload_offset = node.payload_offset;
+			reordered.back().chain_head = new_index[node.chain_head];
+			reordered.back().chain_position = node.chain_position;
+			reordered.back().chain_tail = node.chain_position == 0 ? new_index[node.chain_tail] : no_node;
+			reordered.back().generation = ++generations;
+			reordered.back().descendants = node.descendants;
+			reordered.back().fingerprint = node.fingerprint;
+			reordered.back().sketch = node.sketch;
+			reordered.back().registers = node.registers;
+			reordered.back().ancestors = renumbered_closure(node.ancestors, new_index);
+		}
+
+		std::vector<node_index> reordered_live(reordered.size());
+		for (std::size_t i = 0; i < reordered.size(); ++i) {
+			reordered_live[i] = i;
+			reordered[i].live_position = i;
+		}
+
+		CountRanking reordered_by_descendants;
+		CountRanking reordered_by_children;
+		if (rankings_enabled) {
+			reordered_by_descendants.reserve(reordered.size());
+			reordered_by_children.reserve(reordered.size());
+			for (std::size_t i = 0; i < reordered.size(); ++i) {
+				reordered_by_descendants.insert(i, reordered[i].descendants);
+				reordered_by_children.insert(i, reordered[i].children.size());
+			}
+		}
+
+		for (std::size_t i = 0; i < order.size(); ++i) {
+			reordered[i].virus = std::move(nodes[order[i]].virus);
+		}
+
+		for (auto it = viruses.begin(); it != viruses.end(); ++it) {
+			it.value() = new_index[it.value()];
+		}
+
+		for (auto &stem : stems) {
+			stem = new_index[stem];
 		}
 
-		viruses[id] = new_virus_ptr;
+		nodes.swap(reordered);
+		free_nodes.clear();
+		by_descendants.swap(reordered_by_descendants);
+		by_children.swap(reordered_by_children);
+		live_nodes.swap(reordered_live);
 	}
 
-	void connect(const id_type& child_id, const id_type& parent_id) {
-		if (!exists(parent_id) || !exists(child_id)) {
-			throw VirusNotFound();
+	// Starts keeping every virus ranked by its number of descendants and
+	// by its number of children, so that the top_by_*() queries cost O(k).
+	// Viruses sit in buckets of equal count, so a count moving by one costs
+	// O(1) and any other move O(log n).
+	//
+	// Enabling takes one walk below every virus. Afterwards create() pays
+	// O(1) for every ancestor of the new virus, which is still quadratic in
+	// total when the genealogy is one long chain. remove() pays O(log n)
+	// for every ancestor of the removed virus, plus one walk up from every
+	// virus that survives below the cascade, avoiding it; trees and chains
+	// have no such viruses. connect() recounts, with one walk below each,
+	// the ancestors of the parent not already above the child.
+	void enable_rankings() {
+		if (rankings_enabled) {
+			return;
+		}
+
+		std::vector<node_index> live;
+		live.reserve(viruses.size());
+		for (node_index index = 0; index < nodes.size(); ++index) {
+			if (nodes[index].alive) {
+				live.push_back(index);
+			}
+		}
+
+		auto counts = count_descendants(live, std::unordered_set<node_index>());
+		CountRanking counted_by_descendants;
+		CountRanking counted_by_children;
+		counted_by_descendants.reserve(nodes.size());
+		counted_by_children.reserve(nodes.size());
+		for (auto &count : counts) {
+			counted_by_descendants.insert(count.first, count.second);
+			counted_by_children.insert(count.first, nodes[count.first].children.size());
 		}
 
-		auto parent_node_ptr = viruses.find(parent_id)->second;
-		auto child_node_ptr = viruses.find(child_id)->second;
-		child_node_ptr->add_parent(parent_node_ptr);
-		parent_node_ptr->add_child(child_node_ptr);
+		for (auto &count : counts) {
+			nodes[count.first].descendants = count.second;
+		}
+		by_descendants.swap(counted_by_descendants);
+		by_children.swap(counted_by_children);
+		rankings_enabled = true;
 	}
 
-	void remove(const id_type& id) {
-		if (!exists(id)) {
-			throw VirusNotFound();
+	// The k viruses with the most descendants, with their counts, most
+	// prolific first; ties are in no particular order. Empty unless
+	// enable_rankings() was called.
+	std::vector<std::pair<id_type, std::size_t>> top_by_descendants(std::size_t k) const {
+		return top_of(by_descendants, k);
+	}
+
+	// Like top_by_descendants(), counting only direct children.
+	std::vector<std::pair<id_type, std::size_t>> top_by_children(std::size_t k) const {
+		return top_of(by_children, k);
+	}
+
+	// Starts keeping a MinHash sketch of size hashes of the ancestors of
+	// every virus, so that ancestry_similarity() costs O(size).
+	// A sketch is the entrywise minimum over the parents' sketches and
+	// hashes, so enabling takes one pass in topological order; create()
+	// merges the parents' sketches, and connect() and remove() recompute
+	// sketches below the changed edges, in rank order, only as far as they
+	// actually change.
+	void enable_ancestry_sketches(std::size_t size = 64) {
+		if (sketches_enabled || size == 0) {
+			return;
 		}
 
-		if (id == stem_id) {
-			throw TriedToRemoveStemVirus();
+		std::vector<node_index> order(live_nodes);
+		std::sort(order.begin(), order.end(), [this](node_index a, node_index b) {
+			return nodes[a].rank < nodes[b].rank;
+		});
+
+		std::unordered_map<node_index, sketch_type> computed;
+		sketch_size = size;
+		try {
+			for (auto index : order) {
+				computed.emplace(index, merged_sketch(nodes[index].parents,
+					std::unordered_set<node_index>(), &computed));
+			}
+		} catch (...) {
+			sketch_size = 0;
+			throw;
+		}
+
+		for (auto &entry : computed) {
+			nodes[entry.first].sketch.swap(entry.second);
 		}
-		
-		std::queue<std::shared_ptr<VirusNode>> to_remove;
-		std::map<id_type, std::shared_ptr<VirusNode>> viruses_copy(viruses);
-		
-		auto current_virus = viruses_copy.find(id);
-		to_remove.push(current_virus -> second);
-		
-		while(!to_remove.empty()){
-			auto rem_it = to_remove.front();
-			to_remove.pop();
-			
-			auto new_id = rem_it->id;
-			
-			for (auto parent : rem_it->parents) {
-				parent->children.erase(rem_it);
-			}
-			
-			for (auto child : rem_it->childrens){
-				child->parents.erase(rem_it);
-				if( child->parents.size() == static_cast<size_t>(0)
-					&& child->id != stem_id) {
-						to_remove.push(child);
-				}
-			}
-			
-			viruses_copy.erase(new_id);
-		}
-		
-		viruses.swap(viruses_copy);
+		sketches_enabled = true;
 	}
 
-private:
-	class VirusNode {
-	public:
-		id_type id;
-		Virus virus;
-		std::set<std::shared_ptr<VirusNode>> children;
-		std::set<std::shared_ptr<VirusNode>> parents;
+	// Estimates the Jaccard similarity of the ancestor sets of a and b;
+	// viruses without ancestors count as identical. Without sketches the
+	// exact value is computed from two walks over the ancestors.
+	double ancestry_similarity(const id_type& a, const id_type& b) const {
+		return similarity_of(get_node(a), get_node(b));
+	}
+
+	double ancestry_similarity(const Handle& a, const Handle& b) const {
+		return similarity_of(get_node(a), get_node(b));
+	}
+
+	// Starts keeping a HyperLogLog sketch of 2^precision one-byte registers
+	// of the descendants of every virus, so that estimate_descendants()
+	// takes O(2^precision) time independent of the genealogy, with a
+	// relative standard error of descendant_estimate_error(). A sketch is
+	// the register-wise maximum over the children's sketches and hashes,
+	// so create() and connect() merge the new lineage upwards until an
+	// ancestor's registers stop changing, and remove(), which HyperLogLog
+	// cannot subtract, rebuilds the sketches of the removed virus's
+	// ancestors from their remaining children. precision is clamped to
+	// [4, 16].
+	void enable_descendant_estimates(std::size_t precision = 10) {
+		if (estimates_enabled) {
+			return;
+		}
+
+		std::vector<node_index> order(live_nodes);
+		std::sort(order.begin(), order.end(), [this](node_index a, node_index b) {
+			return nodes[a].rank > nodes[b].rank;
+		});
+
+		register_precision = std::min<std::size_t>(std::max<std::size_t>(precision, 4), 16);
+		planned_registers computed;
+		try {
+			for (auto index : order) {
+				computed.emplace(index, merged_registers(index, std::unordered_set<node_index>(), computed));
+			}
+		} catch (...) {
+			register_precision = 0;
+			throw;
+		}
+
+		apply_registers(computed);
+		estimates_enabled = true;
+	}
+
+	// Estimates the number of descendants of id. Without estimates enabled
+	// the exact number is counted with a walk below id.
+	std::size_t estimate_descendants(const id_type& id) const {
+		return estimate_below(get_node(id));
+	}
+
+	std::size_t estimate_descendants(const Handle& handle) const {
+		return estimate_below(get_node(handle));
+	}
+
+	// The relative standard error of estimate_descendants(), 1.04 divided by
+	// the square root of the register count, or 0 while it counts exactly.
+	double descendant_estimate_error() const noexcept {
+		return estimates_enabled ? 1.04 / std::sqrt(static_cast<double>(register_count())) : 0;
+	}
+
+	// Starts keeping the transitive closure: a bitset over node indices of
+	// the ancestors of every virus, so that is_ancestor() is one bit test
+	// and common_ancestors() a word-wise AND. It takes about n^2 / 8 bytes
+	// for n nodes, which suits genealogies of up to some 100000 viruses.
+	// A bitset is the union of the parents' bitsets and bits, so enabling
+	// takes one pass in topological order; create() merges the parents'
+	// bitsets, and connect() and remove() recompute bitsets below the
+	// changed edges, in rank order, only as far as they actually change.
+	void enable_closure() {
+		if (closure_enabled) {
+			return;
+		}
+
+		std::vector<node_index> order(live_nodes);
+		std::sort(order.begin(), order.end(), [this](node_index a, node_index b) {
+			return nodes[a].rank < nodes[b].rank;
+		});
+
+		planned_closure computed;
+		for (auto index : order) {
+			computed.emplace(index, merged_closure(nodes[index].parents,
+				std::unordered_set<node_index>(), &computed));
+		}
+
+		apply_closure(computed);
+		closure_enabled = true;
+	}
 
-		VirusNode(id_type _id) : id(_id), virus(Virus(_id)) {};
+	// Checks whether id descends from ancestor_id along some lineage.
+	// Without the closure it takes a walk over the ancestors of id.
+	bool is_ancestor(const id_type& ancestor_id, const id_type& id) const {
+		return is_ancestor_node(get_node(ancestor_id), get_node(id));
+	}
+
+	bool is_ancestor(const Handle& ancestor, const Handle& handle) const {
+		return is_ancestor_node(get_node(ancestor), get_node(handle));
+	}
+
+	// Lists the viruses that are ancestors of both a and b, in no
+	// particular order.
+	std::vector<id_type> common_ancestors(const id_type& a, const id_type& b) const {
+		return ids_of(common_ancestors_of(get_node(a), get_node(b)));
+	}
+
+	std::vector<id_type> common_ancestors(const Handle& a, const Handle& b) const {
+		return ids_of(common_ancestors_of(get_node(a), get_node(b)));
+	}
+
+	// Counts the viruses that are ancestors of both a and b.
+	std::size_t common_ancestor_count(const id_type& a, const id_type& b) const {
+		return common_count_of(get_node(a), get_node(b));
+	}
+
+	std::size_t common_ancestor_count(const Handle& a, const Handle& b) const {
+		return common_count_of(get_node(a), get_node(b));
+	}
+
+	// Lists the edges implied by others as (child_id, parent_id) pairs, in
+	// no particular order: those from a parent that is also an ancestor of
+	// another parent of the child. Children are checked in parallel, each
+	// with a walk over the ancestors of its parents that is cut off below
+	// the lowest rank among them, or with bit tests if the closure is
+	// enabled.
+	std::vector<std::pair<id_type, id_type>> find_redundant_edges() const {
+		std::vector<std::pair<id_type, id_type>> edges;
+		for (auto &edge : collect_redundant_edges(false)) {
+			edges.emplace_back(nodes[edge.first].id, nodes[edge.second].id);
+		}
+		return edges;
+	}
+
+	// Drops edges implied by others and returns how many went. Ancestry is
+	// unchanged either way, but an edge dropped here can no longer take
+	// over once the lineage implying it is removed, so the cascades of
+	// later removes may differ.
+	//
+	// With keep_cascades, only edges whose removal keeps every immediate
+	// dominator go, so what remove() deletes right now is unchanged. Only
+	// edges from below the child's immediate dominator qualify, which
+	// leaves out the case feeds create most: connect(2, 0) on the lineage
+	// 0, 1, 2 makes 0 the dominator of 2, so that edge stays. Without
+	// keep_cascades every edge find_redundant_edges() lists goes and
+	// dominators are repaired below the changed viruses; there remove(1)
+	// would then delete 2 as well.
+	std::size_t drop_redundant_edges(bool keep_cascades = true) {
+		auto edges = collect_redundant_edges(keep_cascades);
+		std::vector<node_index> reranked;
+		if (rankings_enabled) {
+			for (auto &edge : edges) {
+				reranked.push_back(edge.second);
+			}
+		}
 
-		void add_child(std::shared_ptr<VirusNode> virus_node) {
-			children.insert(virus_node);
+		std::vector<node_index> relinked;
+		if (chains_enabled) {
+			for (auto &edge : edges) {
+				relinked.push_back(edge.first);
+				relinked.push_back(edge.second);
+			}
 		}
 
-		void remove_child(std::shared_ptr<VirusNode> virus_node) {
-			children.erase(virus_node);
+		for (auto &edge : edges) {
+			erase_sorted(nodes[edge.first].parents, edge.second);
+			erase_sorted(nodes[edge.second].children, edge.first);
 		}
 
-		void add_parent(std::shared_ptr<VirusNode> virus_node) {
-			parents.insert(virus_node);
+		// Erasing left the capacity in place, so putting the edges back on
+		// failure cannot throw. Chain labels follow the adjacency first, as
+		// the dominator climbs use them.
+		update_chains(relinked);
+		std::vector<DominatorUpdate> updates;
+		if (!keep_cascades && !edges.empty()) {
+			try {
+				std::vector<node_index> seeds;
+				for (auto &edge : edges) {
+					seeds.push_back(edge.first);
+				}
+				updates = plan_dominators(seeds, std::unordered_set<node_index>());
+			} catch (...) {
+				for (auto &edge : edges) {
+					insert_sorted(nodes[edge.first].parents, edge.second);
+					insert_sorted(nodes[edge.second].children, edge.first);
+				}
+				update_chains(relinked);
+				throw;
+			}
 		}
+		apply_dominators(updates);
 
-		void remove_parent(std::shared_ptr<VirusNode> virus_node) {
-			parents.erase(virus_node);
+		for (auto parent : reranked) {
+			rerank_children(parent);
 		}
+		return edges.size();
+	}
+
+	// Makes connect() and connect_batch() skip an edge from a virus that
+	// already is an ancestor of the child, which keeps feeds that connect
+	// to a parent and its ancestors from bloating the adjacency. With
+	// keep_cascades, only edges that would move no dominator are skipped,
+	// those from below the child's immediate dominator, as for
+	// drop_redundant_edges(); an edge to a grandparent is still added.
+	// Without it every such edge is skipped, and later removes delete what
+	// they would have if the edge had never been asked for.
+	void skip_implied_edges(bool skip = true, bool keep_cascades = true) noexcept {
+		skipping_implied_edges = skip;
+		skip_keeps_cascades = keep_cascades;
+	}
 
-		void add_parents(std::vector<std::shared_ptr<VirusNode>> virus_nodes) {
-			parents.insert(virus_nodes.begin(), virus_nodes.end());
+	// From now on create() only records the topology, and the Virus of a
+	// new id is constructed on its first access through operator[],
+	// for_each_virus() or aggregate_descendants(). Accesses stay safe to
+	// make concurrently; exceptions of the Virus constructor surface there
+	// instead of in create(). Existing payloads are kept.
+	void enable_lazy_payloads() noexcept {
+		lazy_payloads = true;
+	}
+
+	// Moves payloads out of memory into an append-only file at path: every
+	// payload is written out now, those not yet built in lazy mode
+	// included, and from then on create() writes the Virus of a new id
+	// there instead of keeping it, even with lazy payloads enabled.
+	// payload() and the traversals read stored payloads through a CLOCK
+	// cache of at most cache_bytes of encoded payloads; operator[], which
+	// returns a reference, makes the payload resident again instead, for
+	// the lifetime of the virus. Payloads are encoded with PayloadCodec.
+	void enable_payload_store(const std::string &path, std::size_t cache_bytes = std::size_t(64) << 20) {
+		if (payload_store) {
+			return;
 		}
-	};
 
-	std::map<id_type, std::shared_ptr<VirusNode>> viruses;
+		auto store = std::make_unique<PayloadStore<Virus>>(path, cache_bytes);
+		std::vector<std::pair<node_index, std::uint64_t>> offsets;
+		offsets.reserve(live_nodes.size());
+		for (auto index : live_nodes) {
+			if (nodes[index].virus.built()) {
+				offsets.emplace_back(index, store->append(payload_of(index)));
+			} else {
+				offsets.emplace_back(index, store->append(Virus(nodes[index].id)));
+			}
+		}
 
-	const id_type stem_id;
+		for (auto &entry : offsets) {
+			nodes[entry.first].payload_offset = entry.second;
+			nodes[entry.first].virus.reset();
+		}
+		payload_store = std::move(store);
+	}
+
+	// Starts labelling every maximal chain of unary links, where a virus is
+	// the only child of its only parent, with its first virus and the
+	// position of each virus in it, so that walks cross a chain in one
+	// step: descendant counts, the dominator climbs of create(), dominates()
+	// and preview_remove_count(). remove() itself still visits every virus
+	// it deletes. The adjacency lists, and with them get_children() and
+	// get_parents(), stay as they are. After a modification the labels are
+	// repaired by cutting and joining chains at the changed viruses, which
+	// relabels the part of a chain below the change, so extending a chain
+	// at its end costs O(1).
+	void enable_chain_compression() noexcept {
+		if (chains_enabled) {
+			return;
+		}
+
+		for (auto index : live_nodes) {
+			if (!unary_link_above(index)) {
+				label_chain(index, index, 0, no_node);
+			}
+		}
+		chains_enabled = true;
+	}
+
+	// Returns the id of a virus drawn uniformly at random, in O(1).
+	template<class Generator>
+	id_type sample_virus(Generator &generator) const {
+		std::uniform_int_distribution<std::size_t> pick(0, live_nodes.size() - 1);
+		return nodes[live_nodes[pick(generator)]].id;
+	}
+
+	// Draws count distinct descendants of id uniformly at random, or all of
+	// them if there are fewer, by reservoir sampling during one walk below
+	// id. The order of the result is not random.
+	template<class Generator>
+	std::vector<id_type> sample_descendants(const id_type& id, std::size_t count, Generator &generator) const {
+		return sample_below(get_node(id), count, generator);
+	}
+
+	template<class Generator>
+	std::vector<id_type> sample_descendants(const Handle& handle, std::size_t count, Generator &generator) const {
+		return sample_below(get_node(handle), count, generator);
+	}
+
+	// Calls f(virus) for every virus in the genealogy, in storage order.
+	template<class Function>
+	void for_each_virus(Function f) const {
+		for (node_index index = 0; index < nodes.size(); ++index) {
+			if (nodes[index].alive) {
+				with_payload(index, f);
+			}
+		}
+	}
+
+	// Like for_each_virus(), but the node storage is split into contiguous
+	// chunks processed on separate threads, so f must be safe to call
+	// concurrently. The first exception thrown by f is rethrown once all
+	// chunks are done.
+	template<class Function>
+	void parallel_for_each_virus(Function f) const {
+		parallel_for(nodes.size(), [&](std::size_t begin, std::size_t end) {
+			for (std::size_t i = begin; i < end; ++i) {
+				if (nodes[i].alive) {
+					with_payload(i, f);
+				}
+			}
+		});
+	}
+
+	// Checks the invariants of the node storage and returns descriptions
+	// of at most max_violations of the violations found, lowest node first;
+	// an empty result means the genealogy is sound. Every check only looks
+	// at one node and its neighbours, so nodes are checked in parallel
+	// chunks. Adjacency lists are sorted and unique, point at live nodes
+	// and mirror each other; every virus has a payload unless payloads are
+	// lazy or stored; the id index and the live list hold every live node
+	// and nothing else; exactly the stems have no parents; the rank grows
+	// along every edge; the immediate dominator is a live node one level
+	// up. Enabled indexes agree with the neighbours: the MinHash ancestry
+	// sketches, the HyperLogLog descendant registers, the closure bitsets
+	// and the chain labels. Rising ranks and a parent for every non-stem
+	// together prove that every virus is reachable from a stem without a
+	// traversal.
+	std::vector<std::string> verify(std::size_t max_violations = 16) const {
+		typedef std::pair<node_index, std::string> violation;
+		std::vector<violation> found;
+		std::mutex found_mutex;
+		std::size_t live_count = 0;
+		const std::unordered_set<node_index> no_exclusions;
+		const planned_registers no_plan;
+
+		parallel_for(nodes.size(), [&](std::size_t begin, std::size_t end) {
+			std::vector<violation> local;
+			std::size_t local_live = 0;
+			auto report = [&](node_index index, const std::string &problem) {
+				if (local.size() < max_violations) {
+					local.emplace_back(index, "node " + std::to_string(index) + ": " + problem);
+				}
+			};
+			auto check_links = [&](node_index index, const std::vector<node_index> &links,
+					std::vector<node_index> VirusNode::*mirror, const char *name) {
+				if (!std::is_sorted(links.begin(), links.end())
+					|| std::adjacent_find(links.begin(), links.end()) != links.end()) {
+					report(index, std::string(name) + " not sorted and unique");
+				}
+				for (auto link : links) {
+					if (link >= nodes.size() || !nodes[link].alive) {
+						report(index, std::string(name) + " point at a missing node");
+					} else if (!contains_sorted(nodes[link].*mirror, index)) {
+						report(index, std::string(name) + " not mirrored");
+					}
+				}
+			};
+
+			for (node_index index = begin; index < end; ++index) {
+				const VirusNode &node = nodes[index];
+				if (!node.alive) {
+					continue;
+				}
+				++local_live;
+
+				check_links(index, node.children, &VirusNode::parents, "children");
+				check_links(index, node.parents, &VirusNode::children, "parents");
+				if (!lazy_payloads && !node.virus.built() && node.payload_offset == no_offset) {
+					report(index, "no payload");
+				}
+				auto it = viruses.find(node.id);
+				if (it == viruses.end() || it.value() != index) {
+					report(index, "id not indexed");
+				}
+				if (node.live_position >= live_nodes.size() || live_nodes[node.live_position] != index) {
+					report(index, "missing from the live list");
+				}
+				if (node.stem != node.parents.empty()) {
+					report(index, node.stem ? "stem has parents" : "no parents");
+				}
+				for (auto child : node.children) {
+					if (child < nodes.size() && nodes[child].rank <= node.rank) {
+						report(index, "rank does not grow towards a child");
+					}
+				}
+				if (sketches_enabled && node.sketch != merged_sketch(node.parents, no_exclusions, nullptr)) {
+					report(index, "ancestry sketch stale");
+				}
+				if (estimates_enabled && node.registers != merged_registers(index, no_exclusions, no_plan)) {
+					report(index, "descendant estimate stale");
+				}
+				if (closure_enabled && node.ancestors != merged_closure(node.parents, no_exclusions, nullptr)) {
+					report(index, "closure stale");
+				}
+				if (chains_enabled && !chain_labels_valid(index)) {
+					report(index, "chain labels inconsistent");
+				}
+				if (node.idom != no_node && (node.idom >= nodes.size() || !nodes[node.idom].alive)) {
+					report(index, "dominator is a missing node");
+				} else if (node.dom_depth != depth_of(node.idom) + 1) {
+					report(index, "dominator depth inconsistent");
+				}
+			}
+
+			std::lock_guard<std::mutex> lock(found_mutex);
+			found.insert(found.end(), std::make_move_iterator(local.begin()),
+				std::make_move_iterator(local.end()));
+			live_count += local_live;
+		});
+
+		std::sort(found.begin(), found.end());
+		std::vector<std::string> violations;
+		for (auto &entry : found) {
+			if (violations.size() == max_violations) {
+				break;
+			}
+			violations.push_back(std::move(entry.second));
+		}
+		if (live_count != viruses.size() && violations.size() < max_violations) {
+			violations.push_back("id index holds " + std::to_string(viruses.size())
+				+ " ids for " + std::to_string(live_count) + " nodes");
+		}
+		if (live_count != live_nodes.size() && violations.size() < max_violations) {
+			violations.push_back("live list holds " + std::to_string(live_nodes.size())
+				+ " entries for " + std::to_string(live_count) + " nodes");
+		}
+		return violations;
+	}
+
+	// Folds init(virus) over id and all of its descendants with combine,
+	// which must be associative and commutative. Every descendant is counted
+	// once even if several lineages lead to it: it is attributed to the
+	// parent it was first reached from, and the resulting tree is folded
+	// bottom-up, one breadth-first level at a time across threads.
+	template<class Init, class Combine>
+	auto aggregate_descendants(const id_type& id, Init init, Combine combine) const
+		-> decltype(init(std::declval<const Virus &>())) {
+		return aggregate_below(get_node(id), init, combine);
+	}
+
+	template<class Init, class Combine>
+	auto aggregate_descendants(const Handle& handle, Init init, Combine combine) const
+		-> decltype(init(std::declval<const Virus &>())) {
+		return aggregate_below(get_node(handle), init, combine);
+	}
+
+private:
+	typedef std::size_t node_index;
+
+	static constexpr std::size_t parallel_grain = 4096;
+
+	static constexpr node_index no_node = std::numeric_limits<node_index>::max();
+
+	static constexpr std::uint64_t no_offset = std::numeric_limits<std::uint64_t>::max();
+
+	template<class Init, class Combine>
+	auto aggregate_below(node_index root, Init init, Combine combine) const
+		-> decltype(init(std::declval<const Virus &>())) {
+		typedef decltype(init(std::declval<const Virus &>())) value_type;
+
+		std::vector<node_index> order(1, root);
+		std::vector<std::size_t> owner(1, no_node);
+		std::vector<std::size_t> level_begin(1, 0);
+		std::unordered_map<node_index, std::size_t> position;
+		position.emplace(order[0], 0);
+
+		while (level_begin.back() < order.size()) {
+			std::size_t begin = level_begin.back();
+			std::size_t end = order.size();
+			level_begin.push_back(end);
+			for (std::size_t i = begin; i < end; ++i) {
+				for (auto child : nodes[order[i]].children) {
+					if (position.emplace(child, order.size()).second) {
+						order.push_back(child);
+						owner.push_back(i);
+					}
+				}
+			}
+		}
+
+		std::vector<std::optional<value_type>> values(order.size());
+		for (std::size_t level = level_begin.size() - 1; level-- > 0;) {
+			std::size_t begin = level_begin[level];
+			parallel_for(level_begin[level + 1] - begin, [&](std::size_t from, std::size_t to) {
+				for (std::size_t i = begin + from; i < begin + to; ++i) {
+					value_type value = with_payload(order[i], init);
+					for (auto child : nodes[order[i]].children) {
+						std::size_t child_position = position.find(child)->second;
+						if (owner[child_position] == i) {
+							value = combine(std::move(value), std::move(*values[child_position]));
+						}
+					}
+					values[i].emplace(std::move(value));
+				}
+			});
+		}
+
+		return std::move(*values[0]);
+	}
+
+	// Owns the payload of a node kept in memory, which in lazy mode is only
+	// made by the first get(). Readers racing to construct it publish their
+	// copy with a compare-and-swap and all but the winner discard theirs,
+	// so a payload is never constructed under a lock. Moves and reset()
+	// are modifications of the genealogy and must not overlap any access.
+	class Payload {
+	public:
+		Payload() noexcept : pointer(nullptr) {}
+
+		explicit Payload(std::unique_ptr<Virus> virus) noexcept : pointer(virus.release()) {}
+
+		Payload(Payload &&other) noexcept : pointer(other.pointer.exchange(nullptr, std::memory_order_relaxed)) {}
+
+		Payload &operator=(Payload &&other) noexcept {
+			if (this != &other) {
+				delete pointer.exchange(other.pointer.exchange(nullptr, std::memory_order_relaxed),
+					std::memory_order_relaxed);
+			}
+			return *this;
+		}
+
+		~Payload() {
+			delete pointer.load(std::memory_order_relaxed);
+		}
+
+		bool built() const noexcept {
+			return pointer.load(std::memory_order_acquire) != nullptr;
+		}
+
+		// make returns a std::unique_ptr<Virus>.
+		template<class Make>
+		const Virus &get(Make make) const {
+			Virus *virus = pointer.load(std::memory_order_acquire);
+			if (virus) {
+				return *virus;
+			}
+
+			auto constructed = make();
+			if (pointer.compare_exchange_strong(virus, constructed.get(), std::memory_order_acq_rel,
+					std::memory_order_acquire)) {
+				return *constructed.release();
+			}
+			return *virus;
+		}
+
+		void reset() noexcept {
+			delete pointer.exchange(nullptr, std::memory_order_relaxed);
+		}
+
+	private:
+		mutable std::atomic<Virus *> pointer;
+	};
+
+	class VirusNode {
+	public:
+		id_type id;
+		Payload virus;
+		std::vector<node_index> children;
+		std::vector<node_index> parents;
+		bool alive;
+		// Where the payload store keeps the payload, or no_offset.
+		std::uint64_t payload_offset;
+		// Changes whenever the slot gets a new virus, see Handle.
+		std::size_t generation;
+		bool stem;
+		// Immediate dominator and the depth in the dominator tree. Stems
+		// hang below a virtual root represented by no_node at depth 0.
+		node_index idom;
+		std::size_t dom_depth;
+		// Any number growing along every edge, used to visit nodes in
+		// topological order; it is raised by connect() but never lowered.
+		std::size_t rank;
+		// Number of descendants, kept only while rankings are enabled.
+		std::size_t descendants;
+		// Position in live_nodes.
+		std::size_t live_position;
+		// Random per virus, the input of the MinHash functions.
+		std::uint64_t fingerprint;
+		// MinHash sketch of the ancestors, kept only while sketches are
+		// enabled: entry i is the least hash i over all ancestors.
+		std::vector<std::uint64_t> sketch;
+		// HyperLogLog registers of the descendants, kept only while
+		// estimates are enabled.
+		std::vector<std::uint8_t> registers;
+		// The first node of the chain of unary links through this one and
+		// the position in it, and for the first node the last one; kept
+		// only while chains are enabled.
+		node_index chain_head;
+		std::size_t chain_position;
+		node_index chain_tail;
+		// Bit i is set iff node i is an ancestor, kept only while the
+		// closure is enabled. Missing trailing words are zero.
+		std::vector<std::uint64_t> ancestors;
+
+		VirusNode(const id_type &_id, std::unique_ptr<Virus> _virus)
+			: id(_id), virus(std::move(_virus)), alive(true), payload_offset(no_offset), generation(0), stem(false),
+			idom(no_node), dom_depth(1), rank(0), descendants(0), live_position(0), fingerprint(0),
+			chain_head(no_node), chain_position(0), chain_tail(no_node) {};
+	};
+
+	struct DominatorUpdate {
+		node_index node;
+		node_index idom;
+		std::size_t dom_depth;
+	};
+
+	static void insert_sorted(std::vector<node_index> &indices, node_index index) {
+		indices.insert(std::lower_bound(indices.begin(), indices.end(), index), index);
+	}
+
+	static void erase_sorted(std::vector<node_index> &indices, node_index index) noexcept {
+		auto it = std::lower_bound(indices.begin(), indices.end(), index);
+		if (it != indices.end() && *it == index) {
+			indices.erase(it);
+		}
+	}
+
+	static bool contains_sorted(const std::vector<node_index> &indices, node_index index) noexcept {
+		return std::binary_search(indices.begin(), indices.end(), index);
+	}
+
+	static std::vector<node_index> renumbered(const std::vector<node_index> &indices,
+			const std::vector<node_index> &new_index) {
+		std::vector<node_index> result;
+		result.reserve(indices.size());
+		for (auto index : indices) {
+			result.push_back(new_index[index]);
+		}
+		std::sort(result.begin(), result.end());
+		return result;
+	}
+
+	// Splits [0, count) into contiguous ranges handed to function(begin, end)
+	// on separate threads, at least grain items each; small ranges run on
+	// the calling thread.
+	template<class Function>
+	static void parallel_for(std::size_t count, const Function &function, std::size_t grain = parallel_grain) {
+		std::size_t workers = std::min<std::size_t>(std::thread::hardware_concurrency(),
+			count / grain);
+		if (workers <= 1) {
+			if (count > 0) {
+				function(std::size_t(0), count);
+			}
+			return;
+		}
+
+		std::exception_ptr error;
+		std::mutex error_mutex;
+		auto run = [&](std::size_t begin, std::size_t end) {
+			try {
+				function(begin, end);
+			} catch (...) {
+				std::lock_guard<std::mutex> lock(error_mutex);
+				if (!error) {
+					error = std::current_exception();
+				}
+			}
+		};
+
+		std::vector<std::thread> threads;
+		threads.reserve(workers - 1);
+		try {
+			for (std::size_t worker = 1; worker < workers; ++worker) {
+				threads.emplace_back(run, count * worker / workers, count * (worker + 1) / workers);
+			}
+		} catch (...) {
+			for (auto &thread : threads) {
+				thread.join();
+			}
+			throw;
+		}
+
+		run(0, count / workers);
+		for (auto &thread : threads) {
+			thread.join();
+		}
+
+		if (error) {
+			std::rethrow_exception(error);
+		}
+	}
+
+	node_index get_node(const id_type &id) const {
+		auto it = viruses.find(id);
+		if (it == viruses.end()) {
+			throw VirusNotFound();
+		}
+		return it.value();
+	}
+
+	node_index get_node(const Handle &handle) const {
+		if (!exists(handle)) {
+			throw VirusNotFound();
+		}
+		return handle.index;
+	}
+
+	// Not a constructor of Handle, which would make a brace-enclosed pair of
+	// ids convertible to a Handle and create(id, {a, b}) ambiguous.
+	Handle handle_of(node_index index) const noexcept {
+		Handle handle;
+		handle.index = index;
+		handle.generation = nodes[index].generation;
+		return handle;
+	}
+
+	std::vector<id_type> ids_of(const std::vector<node_index> &indices) const {
+		std::vector<id_type> ids;
+		ids.reserve(indices.size());
+
+		for (auto index : indices) {
+			ids.push_back(nodes[index].id);
+		}
+
+		return ids;
+	}
+
+	node_index allocate_node(const id_type &id) {
+		std::unique_ptr<Virus> virus;
+		std::uint64_t offset = no_offset;
+		if (payload_store) {
+			offset = payload_store->append(Virus(id));
+		} else if (!lazy_payloads) {
+			virus = std::make_unique<Virus>(id);
+		}
+		if (free_nodes.empty()) {
+			nodes.emplace_back(id, std::move(virus));
+			nodes.back().payload_offset = offset;
+			nodes.back().generation = ++generations;
+			nodes.back().fingerprint = mix(generations);
+			return nodes.size() - 1;
+		}
+
+		node_index index = free_nodes.back();
+		nodes[index].id = id;
+		nodes[index].virus = Payload(std::move(virus));
+		nodes[index].payload_offset = offset;
+		nodes[index].alive = true;
+		nodes[index].generation = ++generations;
+		nodes[index].fingerprint = mix(generations);
+		free_nodes.pop_back();
+		return index;
+	}
+
+	// Only called on slots just taken from free_nodes or on nodes being
+	// removed after free_nodes has been reserved, so it never reallocates.
+	void release_node(node_index index) noexcept {
+		VirusNode &node = nodes[index];
+		node.virus.reset();
+		node.children.clear();
+		node.parents.clear();
+		node.alive = false;
+		free_nodes.push_back(index);
+	}
+
+	template<class Parent>
+	Handle create_from(const id_type &id, const std::vector<Parent> &parents) {
+		if (exists(id)) {
+			throw VirusAlreadyCreated();
+		}
+
+		if (parents.empty()) {
+			throw VirusNotFound();
+		}
+
+		std::vector<node_index> parent_nodes;
+		parent_nodes.reserve(parents.size());
+		for (auto &parent : parents) {
+			parent_nodes.push_back(get_node(parent));
+		}
+
+		return add_node(id, std::move(parent_nodes));
+	}
+
+	Handle add_node(const id_type &id, std::vector<node_index> parent_nodes) {
+		std::sort(parent_nodes.begin(), parent_nodes.end());
+		parent_nodes.erase(std::unique(parent_nodes.begin(), parent_nodes.end()),
+			parent_nodes.end());
+		for (auto parent : parent_nodes) {
+			nodes[parent].children.reserve(nodes[parent].children.size() + 1);
+		}
+
+		// Every ancestor gains exactly one descendant, the new virus.
+		std::vector<std::pair<node_index, std::size_t>> counts;
+		if (rankings_enabled) {
+			for (auto ancestor : collect_ancestors(parent_nodes, nullptr)) {
+				counts.emplace_back(ancestor, nodes[ancestor].descendants + 1);
+			}
+			reserve_rankings();
+		}
+
+		sketch_type sketch;
+		if (sketches_enabled) {
+			sketch = merged_sketch(parent_nodes, std::unordered_set<node_index>(), nullptr);
+		}
+
+		closure_type closure;
+		if (closure_enabled) {
+			closure = merged_closure(parent_nodes, std::unordered_set<node_index>(), nullptr);
+		}
+
+		live_nodes.reserve(live_nodes.size() + 1);
+		bool appended = free_nodes.empty();
+		node_index index = allocate_node(id);
+		planned_registers estimates;
+		try {
+			if (estimates_enabled) {
+				estimates.emplace(index, registers_type(register_count(), 0));
+				for (auto parent : parent_nodes) {
+					plan_register_merge(index, parent, estimates);
+				}
+			}
+			viruses.insert(id, index);
+		} catch (...) {
+			if (appended) {
+				nodes.pop_back();
+			} else {
+				release_node(index);
+			}
+			throw;
+		}
+		add_live(index);
+		apply_registers(estimates);
+
+		VirusNode &node = nodes[index];
+		node.sketch.swap(sketch);
+		node.ancestors.swap(closure);
+		node.parents = std::move(parent_nodes);
+		node.idom = node.parents.front();
+		node.rank = 0;
+		for (auto parent : node.parents) {
+			insert_sorted(nodes[parent].children, index);
+			node.idom = common_dominator(node.idom, parent);
+			node.rank = std::max(node.rank, nodes[parent].rank + 1);
+		}
+		node.dom_depth = depth_of(node.idom) + 1;
+		node.chain_head = index;
+		node.chain_position = 0;
+		node.chain_tail = index;
+		update_chains(node.parents);
+
+		if (rankings_enabled) {
+			node.descendants = 0;
+			insert_ranking_entries(index);
+			set_descendants(counts);
+			for (auto parent : nodes[index].parents) {
+				rerank_children(parent);
+			}
+		}
+		return handle_of(index);
+	}
+
+	void connect_nodes(node_index child, node_index parent) {
+		if (child == parent) {
+			throw TriedToCreateCycle();
+		}
+
+		if (contains_sorted(nodes[child].parents, parent)) {
+			return;
+		}
+
+		if (skippable_edge(child, parent)) {
+			return;
+		}
+
+		// The rank walk below the child does not need the edge itself and
+		// reaches the parent iff the edge would close a cycle, so it runs
+		// before the adjacency and the chain labels are touched.
+		rank_log previous_ranks;
+		std::vector<node_index> recounted;
+		std::vector<node_index> relinked;
+		try {
+			raise_rank(child, nodes[parent].rank + 1, parent, previous_ranks);
+			// Only another stem of a forest can get here: everything else
+			// descends from the stem.
+			if (nodes[child].stem) {
+				throw TriedToConnectStemVirus();
+			}
+
+			// Ancestors of the child already count all of its descendants.
+			if (rankings_enabled) {
+				auto unaffected = collect_ancestors(std::vector<node_index>(1, child), nullptr);
+				std::unordered_set<node_index> already_counted(unaffected.begin(), unaffected.end());
+				recounted = collect_ancestors(std::vector<node_index>(1, parent), &already_counted);
+			}
+			if (chains_enabled) {
+				relinked = {child, parent};
+			}
+			nodes[parent].children.reserve(nodes[parent].children.size() + 1);
+		} catch (...) {
+			restore_ranks(previous_ranks);
+			throw;
+		}
+
+		insert_sorted(nodes[child].parents, parent);
+		insert_sorted(nodes[parent].children, child);
+		update_chains(relinked);
+
+		// A new lineage can only change dominators if it bypasses the
+		// current immediate dominator of the child.
+		std::vector<DominatorUpdate> updates;
+		std::vector<std::pair<node_index, std::size_t>> counts;
+		std::vector<SketchUpdate> sketches;
+		planned_registers estimates;
+		planned_closure closure;
+		try {
+			if (common_dominator(nodes[child].idom, parent) != nodes[child].idom) {
+				updates = plan_dominators(std::vector<node_index>(1, child),
+					std::unordered_set<node_index>());
+			}
+			counts = count_descendants(recounted, std::unordered_set<node_index>());
+			sketches = plan_sketches(std::vector<node_index>(1, child), std::unordered_set<node_index>());
+			closure = plan_closure(std::vector<node_index>(1, child), std::unordered_set<node_index>());
+			if (estimates_enabled) {
+				plan_register_merge(child, parent, estimates);
+			}
+		} catch (...) {
+			restore_ranks(previous_ranks);
+			erase_sorted(nodes[child].parents, parent);
+			erase_sorted(nodes[parent].children, child);
+			update_chains(relinked);
+			throw;
+		}
+		apply_dominators(updates);
+		apply_sketches(sketches);
+		apply_registers(estimates);
+		apply_closure(closure);
+
+		if (rankings_enabled) {
+			set_descendants(counts);
+			rerank_children(parent);
+		}
+	}
+
+	// Whether skip_implied_edges() applies to a new edge. The immediate
+	// dominator of the child stays if it also dominates the parent.
+	bool skippable_edge(node_index child, node_index parent) const {
+		if (!skipping_implied_edges) {
+			return false;
+		}
+		if (skip_keeps_cascades && common_dominator(nodes[child].idom, parent) != nodes[child].idom) {
+			return false;
+		}
+		return is_ancestor_node(parent, child);
+	}
+
+	typedef std::pair<node_index, std::vector<node_index>> adjacency_entry;
+
+	template<class Endpoint>
+	void connect_edges(const std::vector<std::pair<Endpoint, Endpoint>> &edges) {
+		std::vector<std::pair<node_index, node_index>> by_child;
+		by_child.reserve(edges.size());
+		for (auto &edge : edges) {
+			by_child.emplace_back(get_node(edge.first), get_node(edge.second));
+			if (by_child.back().first == by_child.back().second) {
+				throw TriedToCreateCycle();
+			}
+		}
+
+		std::sort(by_child.begin(), by_child.end());
+		by_child.erase(std::unique(by_child.begin(), by_child.end()), by_child.end());
+		// Edges skipped against the genealogy before the batch move no
+		// dominator in the one after it either: more lineages can only lift
+		// the child's immediate dominator to one that still dominates the
+		// parent.
+		by_child.erase(std::remove_if(by_child.begin(), by_child.end(),
+			[this](const std::pair<node_index, node_index> &edge) {
+				return contains_sorted(nodes[edge.first].parents, edge.second)
+					|| skippable_edge(edge.first, edge.second);
+			}), by_child.end());
+		if (by_child.empty()) {
+			return;
+		}
+		// A lone edge is checked by the bounded rank walk instead.
+		if (by_child.size() == 1) {
+			connect_nodes(by_child.front().first, by_child.front().second);
+			return;
+		}
+
+		std::vector<std::pair<node_index, node_index>> by_parent;
+		by_parent.reserve(by_child.size());
+		for (auto &edge : by_child) {
+			by_parent.emplace_back(edge.second, edge.first);
+		}
+		std::sort(by_parent.begin(), by_parent.end());
+
+		auto parent_lists = merged_adjacency(by_child, &VirusNode::parents);
+		auto child_lists = merged_adjacency(by_parent, &VirusNode::children);
+		std::vector<node_index> seeds;
+		seeds.reserve(parent_lists.size());
+		for (auto &entry : parent_lists) {
+			seeds.push_back(entry.first);
+		}
+
+		std::vector<node_index> recounted;
+		std::vector<node_index> parents;
+		if (rankings_enabled) {
+			for (auto &entry : child_lists) {
+				parents.push_back(entry.first);
+			}
+			recounted = collect_ancestors(parents, nullptr);
+		}
+
+		// Several new edges can close a cycle none of them closes alone, so
+		// the batch is checked as a whole before anything is touched.
+		if (reaches_cycle(seeds, by_parent)) {
+			throw TriedToCreateCycle();
+		}
+		for (auto &edge : by_child) {
+			if (nodes[edge.first].stem) {
+				throw TriedToConnectStemVirus();
+			}
+		}
+
+		std::vector<node_index> relinked;
+		if (chains_enabled) {
+			for (auto &edge : by_child) {
+				relinked.push_back(edge.first);
+				relinked.push_back(edge.second);
+			}
+		}
+
+		// Swapping the merged lists in and, on failure, back out cannot
+		// throw, so the edges are either all added or none is. Chain labels
+		// follow the adjacency right away, for count_descendants().
+		swap_adjacency(parent_lists, &VirusNode::parents);
+		swap_adjacency(child_lists, &VirusNode::children);
+		update_chains(relinked);
+		std::vector<DominatorUpdate> updates;
+		std::vector<std::pair<node_index, std::size_t>> counts;
+		std::vector<SketchUpdate> sketches;
+		planned_registers estimates;
+		planned_closure closure;
+		rank_log previous_ranks;
+		try {
+			for (auto &edge : by_child) {
+				raise_rank(edge.first, nodes[edge.second].rank + 1, edge.second, previous_ranks);
+			}
+			updates = plan_dominators(seeds, std::unordered_set<node_index>());
+			counts = count_descendants(recounted, std::unordered_set<node_index>());
+			sketches = plan_sketches(seeds, std::unordered_set<node_index>());
+			closure = plan_closure(seeds, std::unordered_set<node_index>());
+			if (estimates_enabled) {
+				for (auto &edge : by_child) {
+					plan_register_merge(edge.first, edge.second, estimates);
+				}
+			}
+		} catch (...) {
+			restore_ranks(previous_ranks);
+			swap_adjacency(parent_lists, &VirusNode::parents);
+			swap_adjacency(child_lists, &VirusNode::children);
+			update_chains(relinked);
+			throw;
+		}
+		apply_dominators(updates);
+		apply_sketches(sketches);
+		apply_registers(estimates);
+		apply_closure(closure);
+
+		if (rankings_enabled) {
+			set_descendants(counts);
+			for (auto parent : parents) {
+				rerank_children(parent);
+			}
+		}
+	}
+
+	// Merges edges, sorted by their first node, into copies of that node's
+	// adjacency list.
+	std::vector<adjacency_entry> merged_adjacency(const std::vector<std::pair<node_index, node_index>> &edges,
+			std::vector<node_index> VirusNode::*list) const {
+		std::vector<adjacency_entry> merged;
+		std::vector<node_index> added;
+		for (std::size_t begin = 0, end; begin < edges.size(); begin = end) {
+			added.clear();
+			for (end = begin; end < edges.size() && edges[end].first == edges[begin].first; ++end) {
+				added.push_back(edges[end].second);
+			}
+
+			const std::vector<node_index> &current = nodes[edges[begin].first].*list;
+			std::vector<node_index> result;
+			result.reserve(current.size() + added.size());
+			std::merge(current.begin(), current.end(), added.begin(), added.end(),
+				std::back_inserter(result));
+			merged.emplace_back(edges[begin].first, std::move(result));
+		}
+		return merged;
+	}
+
+	void swap_adjacency(std::vector<adjacency_entry> &lists, std::vector<node_index> VirusNode::*list) noexcept {
+		for (auto &entry : lists) {
+			(nodes[entry.first].*list).swap(entry.second);
+		}
+	}
+
+	void remove_node(node_index root) {
+		if (nodes[root].stem) {
+			throw TriedToRemoveStemVirus();
+		}
+
+		// Everything that can throw happens before the genealogy is touched,
+		// the unlinking below only shrinks containers.
+		std::unordered_set<node_index> doomed;
+		std::vector<node_index> survivors;
+		auto to_remove = collect_cascade(root, doomed, &survivors);
+		auto updates = plan_dominators(survivors, doomed);
+		auto sketches = plan_sketches(survivors, doomed);
+		auto estimates = plan_register_rebuild(root, doomed);
+		auto closure = plan_closure(survivors, doomed);
+		free_nodes.reserve(free_nodes.size() + to_remove.size());
+
+		std::vector<node_index> relinked;
+		if (chains_enabled) {
+			relinked = survivors;
+			for (auto index : to_remove) {
+				for (auto parent : nodes[index].parents) {
+					if (doomed.count(parent) == 0) {
+						relinked.push_back(parent);
+					}
+				}
+			}
+		}
+
+		// Whatever loses descendants is an ancestor of the root: a virus
+		// outside the cascade with a lineage avoiding the root, that leads
+		// into the cascade, would contradict the root dominating it.
+		std::vector<std::pair<node_index, std::size_t>> counts;
+		std::vector<node_index> reranked;
+		if (rankings_enabled) {
+			auto ancestors = collect_ancestors(nodes[root].parents, nullptr);
+			counts = counts_after_cascade(ancestors, survivors, doomed);
+			for (auto index : to_remove) {
+				for (auto parent : nodes[index].parents) {
+					if (doomed.count(parent) == 0) {
+						reranked.push_back(parent);
+					}
+				}
+			}
+		}
+
+		for (auto index : to_remove) {
+			VirusNode &node = nodes[index];
+			// The rest of the chain below a removed virus goes with it.
+			if (chains_enabled && node.chain_position > 0 && doomed.count(node.parents.front()) == 0) {
+				nodes[node.chain_head].chain_tail = node.parents.front();
+			}
+			for (auto parent : node.parents) {
+				if (doomed.find(parent) == doomed.end()) {
+					erase_sorted(nodes[parent].children, index);
+				}
+			}
+
+			for (auto child : node.children) {
+				if (doomed.find(child) == doomed.end()) {
+					erase_sorted(nodes[child].parents, index);
+				}
+			}
+
+			if (rankings_enabled) {
+				erase_ranking_entries(index);
+			}
+			remove_live(index);
+			viruses.erase(node.id);
+			release_node(index);
+		}
+
+		apply_dominators(updates);
+		apply_sketches(sketches);
+		apply_registers(estimates);
+		apply_closure(closure);
+		update_chains(relinked);
+
+		if (rankings_enabled) {
+			set_descendants(counts);
+			for (auto parent : reranked) {
+				rerank_children(parent);
+			}
+		}
+	}
+
+	std::vector<id_type> preview_cascade(node_index root) const {
+		if (nodes[root].stem) {
+			throw TriedToRemoveStemVirus();
+		}
+
+		std::unordered_set<node_index> doomed;
+		return ids_of(collect_cascade(root, doomed, nullptr));
+	}
+
+	std::size_t preview_cascade_count(node_index root) const {
+		if (nodes[root].stem) {
+			throw TriedToRemoveStemVirus();
+		}
+
+		if (chains_enabled) {
+			return count_cascade(root);
+		}
+
+		std::unordered_set<node_index> doomed;
+		return collect_cascade(root, doomed, nullptr).size();
+	}
+
+	id_type dominator_of(node_index index) const {
+		node_index idom = nodes[index].idom;
+		return nodes[idom == no_node ? index : idom].id;
+	}
+
+	bool dominates_node(node_index dominator, node_index index) const noexcept {
+		while (index != no_node && depth_of(index) > nodes[dominator].dom_depth) {
+			if (chains_enabled && nodes[index].chain_position > 0) {
+				if (nodes[dominator].chain_head == nodes[index].chain_head) {
+					return nodes[dominator].chain_position <= nodes[index].chain_position;
+				}
+				index = nodes[index].chain_head;
+				continue;
+			}
+			index = nodes[index].idom;
+		}
+		return index == dominator;
+	}
+
+	// Adds a virus without parents that remove() refuses to delete.
+	node_index add_stem(const id_type &id) {
+		if (exists(id)) {
+			throw VirusAlreadyCreated();
+		}
+
+		stems.reserve(stems.size() + 1);
+		if (rankings_enabled) {
+			reserve_rankings();
+		}
+
+		sketch_type sketch;
+		if (sketches_enabled) {
+			sketch.assign(sketch_size, empty_hash);
+		}
+
+		registers_type registers;
+		if (estimates_enabled) {
+			registers.assign(register_count(), 0);
+		}
+
+		live_nodes.reserve(live_nodes.size() + 1);
+		bool appended = free_nodes.empty();
+		node_index index = allocate_node(id);
+		try {
+			viruses.insert(id, index);
+		} catch (...) {
+			if (appended) {
+				nodes.pop_back();
+			} else {
+				release_node(index);
+			}
+			throw;
+		}
+		add_live(index);
+
+		nodes[index].registers.swap(registers);
+		nodes[index].sketch.swap(sketch);
+		nodes[index].ancestors.clear();
+		nodes[index].chain_head = index;
+		nodes[index].chain_position = 0;
+		nodes[index].chain_tail = index;
+		nodes[index].stem = true;
+		nodes[index].idom = no_node;
+		nodes[index].dom_depth = 1;
+		stems.push_back(index);
+		if (rankings_enabled) {
+			nodes[index].descendants = 0;
+			insert_ranking_entries(index);
+		}
+		return index;
+	}
+
+	typedef std::vector<std::uint64_t> sketch_type;
+
+	static constexpr std::uint64_t empty_hash = std::numeric_limits<std::uint64_t>::max();
+
+	struct SketchUpdate {
+		node_index node;
+		sketch_type sketch;
+	};
+
+	// The splitmix64 finalizer.
+	static std::uint64_t mix(std::uint64_t value) noexcept {
+		value += 0x9e3779b97f4a7c15ULL;
+		value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+		return value ^ (value >> 31);
+	}
+
+	// The sketch of a virus with the given parents, reading the sketch of
+	// a parent from planned if it is there.
+	sketch_type merged_sketch(const std::vector<node_index> &parents,
+			const std::unordered_set<node_index> &excluded,
+			const std::unordered_map<node_index, sketch_type> *planned) const {
+		sketch_type sketch(sketch_size, empty_hash);
+		for (auto parent : parents) {
+			if (excluded.count(parent) != 0) {
+				continue;
+			}
+
+			const sketch_type *parent_sketch = &nodes[parent].sketch;
+			if (planned) {
+				auto it = planned->find(parent);
+				if (it != planned->end()) {
+					parent_sketch = &it->second;
+				}
+			}
+			for (std::size_t i = 0; i < sketch_size; ++i) {
+				std::uint64_t hash = mix(nodes[parent].fingerprint ^ mix(i));
+				sketch[i] = std::min(sketch[i], std::min((*parent_sketch)[i], hash));
+			}
+		}
+		return sketch;
+	}
+
+	// Recomputes sketches from seeds downwards, as if the excluded nodes
+	// were gone, in rank order like plan_dominators(), and only continues
+	// below nodes whose sketch changed.
+	std::vector<SketchUpdate> plan_sketches(const std::vector<node_index> &seeds,
+			const std::unordered_set<node_index> &excluded) const {
+		std::vector<SketchUpdate> updates;
+		if (!sketches_enabled) {
+			return updates;
+		}
+
+		typedef std::pair<std::size_t, node_index> ranked_node;
+		std::priority_queue<ranked_node, std::vector<ranked_node>, std::greater<ranked_node>> pending;
+		std::unordered_set<node_index> queued;
+		std::unordered_map<node_index, sketch_type> planned;
+
+		for (auto seed : seeds) {
+			if (queued.insert(seed).second) {
+				pending.emplace(nodes[seed].rank, seed);
+			}
+		}
+
+		while (!pending.empty()) {
+			node_index current = pending.top().second;
+			pending.pop();
+			if (nodes[current].stem) {
+				continue;
+			}
+
+			sketch_type sketch = merged_sketch(nodes[current].parents, excluded, &planned);
+			if (sketch == nodes[current].sketch) {
+				continue;
+			}
+
+			planned.emplace(current, std::move(sketch));
+			for (auto child : nodes[current].children) {
+				if (excluded.count(child) == 0 && queued.insert(child).second) {
+					pending.emplace(nodes[child].rank, child);
+				}
+			}
+		}
+
+		updates.reserve(planned.size());
+		for (auto &entry : planned) {
+			updates.push_back(SketchUpdate{entry.first, std::move(entry.second)});
+		}
+		return updates;
+	}
+
+	void apply_sketches(std::vector<SketchUpdate> &updates) noexcept {
+		for (auto &update : updates) {
+			nodes[update.node].sketch.swap(update.sketch);
+		}
+	}
+
+	double similarity_of(node_index a, node_index b) const {
+		if (sketches_enabled) {
+			std::size_t equal = 0;
+			for (std::size_t i = 0; i < sketch_size; ++i) {
+				equal += nodes[a].sketch[i] == nodes[b].sketch[i];
+			}
+			return static_cast<double>(equal) / sketch_size;
+		}
+
+		auto ancestors_of = [this](node_index index) {
+			auto ancestors = collect_ancestors(nodes[index].parents, nullptr);
+			return std::unordered_set<node_index>(ancestors.begin(), ancestors.end());
+		};
+		auto first = ancestors_of(a);
+		auto second = ancestors_of(b);
+		if (first.empty() && second.empty()) {
+			return 1;
+		}
+
+		std::size_t common = 0;
+		for (auto index : first) {
+			common += second.count(index);
+		}
+		return static_cast<double>(common) / (first.size() + second.size() - common);
+	}
+
+	typedef std::vector<std::uint8_t> registers_type;
+
+	typedef std::unordered_map<node_index, registers_type> planned_registers;
+
+	std::size_t register_count() const noexcept {
+		return std::size_t(1) << register_precision;
+	}
+
+	// Adds the hash of a virus to registers: the leading precision bits
+	// pick the register, which keeps the largest position of the first set
+	// bit seen among the remaining bits.
+	void add_hash(registers_type &registers, node_index index) const noexcept {
+		std::uint64_t hash = mix(~nodes[index].fingerprint);
+		std::size_t slot = hash >> (64 - register_precision);
+		std::uint64_t rest = hash << register_precision;
+		std::uint8_t position = 1;
+		while (position <= 64 - register_precision && !(rest >> 63)) {
+			rest <<= 1;
+			++position;
+		}
+		registers[slot] = std::max(registers[slot], position);
+	}
+
+	const registers_type &registers_of(node_index index, const planned_registers &planned) const {
+		auto it = planned.find(index);
+		return it == planned.end() ? nodes[index].registers : it->second;
+	}
+
+	registers_type merged_registers(node_index index, const std::unordered_set<node_index> &excluded,
+			const planned_registers &planned) const {
+		registers_type registers(register_count(), 0);
+		for (auto child : nodes[index].children) {
+			if (excluded.count(child) != 0) {
+				continue;
+			}
+			const registers_type &child_registers = registers_of(child, planned);
+			for (std::size_t i = 0; i < registers.size(); ++i) {
+				registers[i] = std::max(registers[i], child_registers[i]);
+			}
+			add_hash(registers, child);
+		}
+		return registers;
+	}
+
+	// Plans merging from and its descendants into to and its ancestors.
+	// The descendants of a virus include those of each of its children, so
+	// once the registers of a virus do not change, neither do those of
+	// anything above it.
+	void plan_register_merge(node_index from, node_index to, planned_registers &planned) const {
+		registers_type added = registers_of(from, planned);
+		add_hash(added, from);
+
+		std::vector<node_index> pending(1, to);
+		while (!pending.empty()) {
+			node_index current = pending.back();
+			pending.pop_back();
+
+			registers_type merged = registers_of(current, planned);
+			bool changed = false;
+			for (std::size_t i = 0; i < merged.size(); ++i) {
+				if (added[i] > merged[i]) {
+					merged[i] = added[i];
+					changed = true;
+				}
+			}
+			if (!changed) {
+				continue;
+			}
+
+			planned[current] = std::move(merged);
+			pending.insert(pending.end(), nodes[current].parents.begin(), nodes[current].parents.end());
+		}
+	}
+
+	// Plans rebuilding the registers of the ancestors of root, the only
+	// viruses that lose descendants when the excluded cascade goes, from
+	// the bottom up.
+	planned_registers plan_register_rebuild(node_index root, const std::unordered_set<node_index> &excluded) const {
+		planned_registers planned;
+		if (!estimates_enabled) {
+			return planned;
+		}
+
+		auto ancestors = collect_ancestors(nodes[root].parents, nullptr);
+		std::sort(ancestors.begin(), ancestors.end(), [this](node_index a, node_index b) {
+			return nodes[a].rank > nodes[b].rank;
+		});
+		for (auto ancestor : ancestors) {
+			planned.emplace(ancestor, merged_registers(ancestor, excluded, planned));
+		}
+		return planned;
+	}
+
+	void apply_registers(planned_registers &planned) noexcept {
+		for (auto &entry : planned) {
+			nodes[entry.first].registers.swap(entry.second);
+		}
+	}
+
+	// The HyperLogLog estimate with linear counting for small cardinalities.
+	std::size_t estimate_below(node_index index) const {
+		if (!estimates_enabled) {
+			return count_descendants(std::vector<node_index>(1, index), std::unordered_set<node_index>())[0].second;
+		}
+
+		const registers_type &registers = nodes[index].registers;
+		double count = static_cast<double>(registers.size());
+		double sum = 0;
+		std::size_t zeros = 0;
+		for (auto value : registers) {
+			sum += std::ldexp(1.0, -static_cast<int>(value));
+			zeros += value == 0;
+		}
+
+		double alpha = registers.size() == 16 ? 0.673 : registers.size() == 32 ? 0.697
+			: registers.size() == 64 ? 0.709 : 0.7213 / (1 + 1.079 / count);
+		double estimate = alpha * count * count / sum;
+		if (estimate <= 2.5 * count && zeros != 0) {
+			estimate = count * std::log(count / zeros);
+		}
+		return static_cast<std::size_t>(std::llround(estimate));
+	}
+
+	typedef std::vector<std::uint64_t> closure_type;
+
+	typedef std::unordered_map<node_index, closure_type> planned_closure;
+
+	static bool test_bit(const closure_type &bits, node_index index) noexcept {
+		return index / 64 < bits.size() && (bits[index / 64] >> (index % 64) & 1) != 0;
+	}
+
+	static void set_bit(closure_type &bits, node_index index) {
+		if (bits.size() <= index / 64) {
+			bits.resize(index / 64 + 1, 0);
+		}
+		bits[index / 64] |= std::uint64_t(1) << (index % 64);
+	}
+
+	static std::size_t lowest_bit(std::uint64_t word) noexcept {
+		return std::bitset<64>((word & (~word + 1)) - 1).count();
+	}
+
+	// Calls f(index) for every bit set in bits, lowest first.
+	template<class Function>
+	static void for_each_bit(const closure_type &bits, Function f) {
+		for (std::size_t word = 0; word < bits.size(); ++word) {
+			for (std::uint64_t rest = bits[word]; rest != 0; rest &= rest - 1) {
+				f(word * 64 + lowest_bit(rest));
+			}
+		}
+	}
+
+	// The bitset of a virus with the given parents, reading the bitset of
+	// a parent from planned if it is there. The word loop has no
+	// dependencies between iterations, so it is left to the compiler to
+	// vectorize.
+	closure_type merged_closure(const std::vector<node_index> &parents,
+			const std::unordered_set<node_index> &excluded, const planned_closure *planned) const {
+		closure_type bits;
+		for (auto parent : parents) {
+			if (excluded.count(parent) != 0) {
+				continue;
+			}
+
+			const closure_type *parent_bits = &nodes[parent].ancestors;
+			if (planned) {
+				auto it = planned->find(parent);
+				if (it != planned->end()) {
+					parent_bits = &it->second;
+				}
+			}
+			if (bits.size() < parent_bits->size()) {
+				bits.resize(parent_bits->size(), 0);
+			}
+			for (std::size_t i = 0; i < parent_bits->size(); ++i) {
+				bits[i] |= (*parent_bits)[i];
+			}
+			set_bit(bits, parent);
+		}
+
+		while (!bits.empty() && bits.back() == 0) {
+			bits.pop_back();
+		}
+		return bits;
+	}
+
+	// Recomputes bitsets from seeds downwards like plan_sketches(). Every
+	// node with an excluded ancestor lies below seeds, so this also clears
+	// the bits of removed nodes before their slots are reused.
+	planned_closure plan_closure(const std::vector<node_index> &seeds,
+			const std::unordered_set<node_index> &excluded) const {
+		planned_closure planned;
+		if (!closure_enabled) {
+			return planned;
+		}
+
+		typedef std::pair<std::size_t, node_index> ranked_node;
+		std::priority_queue<ranked_node, std::vector<ranked_node>, std::greater<ranked_node>> pending;
+		std::unordered_set<node_index> queued;
+		for (auto seed : seeds) {
+			if (queued.insert(seed).second) {
+				pending.emplace(nodes[seed].rank, seed);
+			}
+		}
+
+		while (!pending.empty()) {
+			node_index current = pending.top().second;
+			pending.pop();
+			if (nodes[current].stem) {
+				continue;
+			}
+
+			closure_type bits = merged_closure(nodes[current].parents, excluded, &planned);
+			if (bits == nodes[current].ancestors) {
+				continue;
+			}
+
+			planned.emplace(current, std::move(bits));
+			for (auto child : nodes[current].children) {
+				if (excluded.count(child) == 0 && queued.insert(child).second) {
+					pending.emplace(nodes[child].rank, child);
+				}
+			}
+		}
+		return planned;
+	}
+
+	void apply_closure(planned_closure &planned) noexcept {
+		for (auto &entry : planned) {
+			nodes[entry.first].ancestors.swap(entry.second);
+		}
+	}
+
+	static closure_type renumbered_closure(const closure_type &bits, const std::vector<node_index> &new_index) {
+		closure_type result;
+		for_each_bit(bits, [&](node_index index) {
+			set_bit(result, new_index[index]);
+		});
+		return result;
+	}
+
+	bool is_ancestor_node(node_index ancestor, node_index index) const {
+		if (closure_enabled) {
+			return test_bit(nodes[index].ancestors, ancestor);
+		}
+
+		auto ancestors = collect_ancestors(nodes[index].parents, nullptr);
+		return std::find(ancestors.begin(), ancestors.end(), ancestor) != ancestors.end();
+	}
+
+	std::vector<node_index> common_ancestors_of(node_index a, node_index b) const {
+		std::vector<node_index> common;
+		if (closure_enabled) {
+			const closure_type &first = nodes[a].ancestors;
+			const closure_type &second = nodes[b].ancestors;
+			closure_type both(std::min(first.size(), second.size()));
+			for (std::size_t i = 0; i < both.size(); ++i) {
+				both[i] = first[i] & second[i];
+			}
+			for_each_bit(both, [&](node_index index) {
+				common.push_back(index);
+			});
+			return common;
+		}
+
+		auto first = collect_ancestors(nodes[a].parents, nullptr);
+		auto second = collect_ancestors(nodes[b].parents, nullptr);
+		std::unordered_set<node_index> second_set(second.begin(), second.end());
+		for (auto index : first) {
+			if (second_set.count(index) != 0) {
+				common.push_back(index);
+			}
+		}
+		return common;
+	}
+
+	std::size_t common_count_of(node_index a, node_index b) const {
+		if (!closure_enabled) {
+			return common_ancestors_of(a, b).size();
+		}
+
+		const closure_type &first = nodes[a].ancestors;
+		const closure_type &second = nodes[b].ancestors;
+		std::size_t count = 0;
+		for (std::size_t i = 0; i < std::min(first.size(), second.size()); ++i) {
+			count += std::bitset<64>(first[i] & second[i]).count();
+		}
+		return count;
+	}
+
+	// The parents of index that are also ancestors of another of its
+	// parents. A node of lower rank than every parent cannot be one, and
+	// neither can its ancestors, so the walk stops there.
+	std::vector<node_index> implied_parents(node_index index) const {
+		std::vector<node_index> implied;
+		const std::vector<node_index> &parents = nodes[index].parents;
+		if (parents.size() < 2) {
+			return implied;
+		}
+
+		if (closure_enabled) {
+			for (auto parent : parents) {
+				for (auto other : parents) {
+					if (test_bit(nodes[other].ancestors, parent)) {
+						implied.push_back(parent);
+						break;
+					}
+				}
+			}
+			return implied;
+		}
+
+		std::size_t lowest = nodes[parents.front()].rank;
+		for (auto parent : parents) {
+			lowest = std::min(lowest, nodes[parent].rank);
+		}
+
+		std::unordered_set<node_index> seen;
+		std::vector<node_index> pending(parents);
+		while (!pending.empty()) {
+			node_index current = pending.back();
+			pending.pop_back();
+			for (auto parent : nodes[current].parents) {
+				if (nodes[parent].rank >= lowest && seen.insert(parent).second) {
+					pending.push_back(parent);
+				}
+			}
+		}
+
+		for (auto parent : parents) {
+			if (seen.count(parent) != 0) {
+				implied.push_back(parent);
+			}
+		}
+		return implied;
+	}
+
+	// Dropping implied edges keeps ancestry, so the immediate dominator of
+	// index, the common dominator of its parents, is all that can move,
+	// and with it the dominator tree. Implied parents are dropped one by
+	// one as long as the remaining ones keep it.
+	std::vector<node_index> droppable_parents(node_index index) const {
+		std::vector<node_index> dropped;
+		std::vector<node_index> kept(nodes[index].parents);
+		for (auto parent : implied_parents(index)) {
+			node_index idom = no_node;
+			bool first = true;
+			for (auto other : kept) {
+				if (other != parent) {
+					idom = first ? other : common_dominator(idom, other);
+					first = false;
+				}
+			}
+
+			if (idom == nodes[index].idom) {
+				erase_sorted(kept, parent);
+				dropped.push_back(parent);
+			}
+		}
+		return dropped;
+	}
+
+	// (child, parent) edges found by implied_parents(), or by
+	// droppable_parents() if droppable is set.
+	std::vector<std::pair<node_index, node_index>> collect_redundant_edges(bool droppable) const {
+		std::vector<std::pair<node_index, node_index>> edges;
+		std::mutex edges_mutex;
+		parallel_for(nodes.size(), [&](std::size_t begin, std::size_t end) {
+			std::vector<std::pair<node_index, node_index>> local;
+			for (node_index index = begin; index < end; ++index) {
+				if (!nodes[index].alive) {
+					continue;
+				}
+				for (auto parent : droppable ? droppable_parents(index) : implied_parents(index)) {
+					local.emplace_back(index, parent);
+				}
+			}
+
+			std::lock_guard<std::mutex> lock(edges_mutex);
+			edges.insert(edges.end(), local.begin(), local.end());
+		});
+		return edges;
+	}
+
+	// A stored payload is faulted into the node, see operator[].
+	const Virus &payload_of(node_index index) const {
+		const VirusNode &node = nodes[index];
+		if (node.payload_offset != no_offset) {
+			return node.virus.get([&] {
+				return payload_store->read(node.payload_offset);
+			});
+		}
+		return node.virus.get([&] {
+			return std::make_unique<Virus>(node.id);
+		});
+	}
+
+	// A stored payload that is not resident goes through the cache.
+	std::shared_ptr<const Virus> shared_payload(node_index index) const {
+		const VirusNode &node = nodes[index];
+		if (node.payload_offset == no_offset || node.virus.built()) {
+			return std::shared_ptr<const Virus>(std::shared_ptr<const Virus>(), &payload_of(index));
+		}
+		return payload_store->load(node.payload_offset);
+	}
+
+	// Calls f with the payload of index, holding a stored one that is not
+	// resident only for the duration of the call.
+	template<class Function>
+	auto with_payload(node_index index, Function &f) const -> decltype(f(std::declval<const Virus &>())) {
+		const VirusNode &node = nodes[index];
+		if (node.payload_offset == no_offset || node.virus.built()) {
+			return f(payload_of(index));
+		}
+		auto virus = payload_store->load(node.payload_offset);
+		return f(*virus);
+	}
+
+	// Puts a node into live_nodes, which has been reserved for it.
+	void add_live(node_index index) noexcept {
+		nodes[index].live_position = live_nodes.size();
+		live_nodes.push_back(index);
+	}
+
+	void remove_live(node_index index) noexcept {
+		node_index last = live_nodes.back();
+		live_nodes[nodes[index].live_position] = last;
+		nodes[last].live_position = nodes[index].live_position;
+		live_nodes.pop_back();
+	}
+
+	template<class Generator>
+	std::vector<id_type> sample_below(node_index root, std::size_t count, Generator &generator) const {
+		std::vector<node_index> sample;
+		std::unordered_set<node_index> seen;
+		std::vector<node_index> pending(1, root);
+		std::size_t visited = 0;
+
+		while (!pending.empty()) {
+			node_index current = pending.back();
+			pending.pop_back();
+			for (auto child : nodes[current].children) {
+				if (!seen.insert(child).second) {
+					continue;
+				}
+				pending.push_back(child);
+
+				if (++visited <= count) {
+					sample.push_back(child);
+				} else {
+					std::uniform_int_distribution<std::size_t> pick(0, visited - 1);
+					std::size_t slot = pick(generator);
+					if (slot < count) {
+						sample[slot] = child;
+					}
+				}
+			}
+		}
+		return ids_of(sample);
+	}
+
+	// Viruses grouped into buckets of equal count, a map from each count to
+	// the first virus of an intrusive list threaded through links. Moving a
+	// virus to the next or previous count costs O(1), to any other count
+	// O(log n), and the k highest counts are listed in O(k). Buckets come
+	// from a pool that reserve() fills beforehand, so that no update can
+	// throw.
+	class CountRanking {
+	public:
+		// Makes room for the nodes below slots, one bucket each and one
+		// more for a move, which takes its new bucket before freeing the
+		// old one.
+		void reserve(std::size_t slots) {
+			if (links.size() < slots) {
+				links.resize(slots);
+				bucket_of.resize(slots);
+			}
+			spare.reserve(slots + 1);
+			while (buckets.size() + spare.size() < slots + 1) {
+				bucket_map scratch;
+				scratch.emplace(0, no_node);
+				spare.push_back(scratch.extract(scratch.begin()));
+			}
+		}
+
+		void insert(node_index index, std::size_t count) noexcept {
+			link(index, bucket_at(count, buckets.lower_bound(count)));
+		}
+
+		void erase(node_index index) noexcept {
+			unlink(index);
+		}
+
+		void move(node_index index, std::size_t count) noexcept {
+			auto from = bucket_of[index];
+			if (from->first == count) {
+				return;
+			}
+
+			auto hint = buckets.end();
+			if (count == from->first + 1) {
+				hint = std::next(from);
+			} else if (count + 1 == from->first) {
+				hint = from != buckets.begin() && std::prev(from)->first == count ? std::prev(from) : from;
+			} else {
+				hint = buckets.lower_bound(count);
+			}
+			auto to = bucket_at(count, hint);
+			unlink(index);
+			link(index, to);
+		}
+
+		void swap(CountRanking &other) noexcept {
+			buckets.swap(other.buckets);
+			spare.swap(other.spare);
+			links.swap(other.links);
+			bucket_of.swap(other.bucket_of);
+		}
+
+		// Calls f(index, count) for the k nodes with the highest counts.
+		template<class Function>
+		void for_each_top(std::size_t k, Function f) const {
+			for (auto it = buckets.rbegin(); it != buckets.rend() && k > 0; ++it) {
+				for (node_index index = it->second; index != no_node && k > 0; index = links[index].second, --k) {
+					f(index, it->first);
+				}
+			}
+		}
+
+	private:
+		typedef std::map<std::size_t, node_index> bucket_map;
+
+		// The bucket for count, made at hint, the first one past it, if
+		// there is none.
+		typename bucket_map::iterator bucket_at(std::size_t count, typename bucket_map::iterator hint) noexcept {
+			if (hint != buckets.end() && hint->first == count) {
+				return hint;
+			}
+			auto bucket = std::move(spare.back());
+			spare.pop_back();
+			bucket.key() = count;
+			bucket.mapped() = no_node;
+			return buckets.insert(hint, std::move(bucket));
+		}
+
+		void link(node_index index, typename bucket_map::iterator bucket) noexcept {
+			links[index] = std::make_pair(no_node, bucket->second);
+			if (bucket->second != no_node) {
+				links[bucket->second].first = index;
+			}
+			bucket->second = index;
+			bucket_of[index] = bucket;
+		}
+
+		void unlink(node_index index) noexcept {
+			auto bucket = bucket_of[index];
+			node_index previous = links[index].first;
+			node_index next = links[index].second;
+			if (previous == no_node) {
+				bucket->second = next;
+			} else {
+				links[previous].second = next;
+			}
+			if (next != no_node) {
+				links[next].first = previous;
+			}
+			if (bucket->second == no_node) {
+				spare.push_back(buckets.extract(bucket));
+			}
+		}
+
+		bucket_map buckets;
+
+		// Unused buckets; the capacity covers every bucket, so returning
+		// one never allocates.
+		std::vector<typename bucket_map::node_type> spare;
+
+		// The previous and next node in the bucket of each node.
+		std::vector<std::pair<node_index, node_index>> links;
+
+		std::vector<typename bucket_map::iterator> bucket_of;
+	};
+
+	// Collects from and every ancestor of it, skipping the excluded nodes
+	// and everything reachable only through them.
+	std::vector<node_index> collect_ancestors(const std::vector<node_index> &from,
+			const std::unordered_set<node_index> *excluded) const {
+		std::vector<node_index> ancestors;
+		std::unordered_set<node_index> seen;
+		for (auto index : from) {
+			if ((!excluded || excluded->count(index) == 0) && seen.insert(index).second) {
+				ancestors.push_back(index);
+			}
+		}
+
+		// Starting from one node, a parent with a single child can only be
+		// reached through that child, so it skips the lookup.
+		bool single_start = ancestors.size() == 1;
+		for (std::size_t i = 0; i < ancestors.size(); ++i) {
+			for (auto parent : nodes[ancestors[i]].parents) {
+				if ((!excluded || excluded->count(parent) == 0)
+					&& ((single_start && nodes[parent].children.size() == 1) || seen.insert(parent).second)) {
+					ancestors.push_back(parent);
+				}
+			}
+		}
+		return ancestors;
+	}
+
+	// The descendant counts of ancestors, all of them ancestors of a
+	// cascade, once the cascade is gone. Each loses the whole cascade, as
+	// every doomed virus lies below all of them, and of the viruses below
+	// the cascade, which hang from survivors, those it reaches only through
+	// the cascade. One walk up from each of those, avoiding the cascade,
+	// tells which ancestors keep it. Trees and chains have none of them.
+	std::vector<std::pair<node_index, std::size_t>> counts_after_cascade(const std::vector<node_index> &ancestors,
+			const std::vector<node_index> &survivors, const std::unordered_set<node_index> &doomed) const {
+		std::vector<node_index> below;
+		std::unordered_set<node_index> seen;
+		for (auto survivor : survivors) {
+			if (seen.insert(survivor).second) {
+				below.push_back(survivor);
+			}
+		}
+		for (std::size_t i = 0; i < below.size(); ++i) {
+			for (auto child : nodes[below[i]].children) {
+				if (seen.insert(child).second) {
+					below.push_back(child);
+				}
+			}
+		}
+
+		const std::unordered_set<node_index> counted(ancestors.begin(), ancestors.end());
+		std::unordered_map<node_index, std::size_t> kept;
+		std::mutex kept_mutex;
+		parallel_for(below.size(), [&](std::size_t begin, std::size_t end) {
+			std::unordered_map<node_index, std::size_t> local;
+			for (std::size_t i = begin; i < end; ++i) {
+				for (auto ancestor : collect_ancestors(std::vector<node_index>(1, below[i]), &doomed)) {
+					if (counted.count(ancestor) != 0) {
+						++local[ancestor];
+					}
+				}
+			}
+			std::lock_guard<std::mutex> lock(kept_mutex);
+			for (auto &entry : local) {
+				kept[entry.first] += entry.second;
+			}
+		}, 1);
+
+		std::vector<std::pair<node_index, std::size_t>> counts;
+		counts.reserve(ancestors.size());
+		for (auto ancestor : ancestors) {
+			auto it = kept.find(ancestor);
+			std::size_t lost = doomed.size() + below.size() - (it == kept.end() ? 0 : it->second);
+			counts.emplace_back(ancestor, nodes[ancestor].descendants - lost);
+		}
+		return counts;
+	}
+
+	// Counts the descendants of each of the given nodes, as if the excluded
+	// nodes were gone, with one walk per node spread across threads.
+	std::vector<std::pair<node_index, std::size_t>> count_descendants(const std::vector<node_index> &roots,
+			const std::unordered_set<node_index> &excluded) const {
+		// Past the entry a chain can only be reached through the previous
+		// virus, so without exclusions it is counted at once.
+		bool skip_chains = chains_enabled && excluded.empty();
+		std::vector<std::pair<node_index, std::size_t>> counts(roots.size());
+		parallel_for(roots.size(), [&](std::size_t begin, std::size_t end) {
+			std::unordered_set<node_index> seen;
+			std::vector<node_index> pending;
+			for (std::size_t i = begin; i < end; ++i) {
+				seen.clear();
+				std::size_t skipped = 0;
+				pending.assign(1, roots[i]);
+				while (!pending.empty()) {
+					node_index current = pending.back();
+					pending.pop_back();
+					for (auto child : nodes[current].children) {
+						if (excluded.count(child) == 0 && seen.insert(child).second) {
+							if (skip_chains) {
+								node_index tail = nodes[nodes[child].chain_head].chain_tail;
+								skipped += nodes[tail].chain_position - nodes[child].chain_position;
+								child = tail;
+							}
+							pending.push_back(child);
+						}
+					}
+				}
+				counts[i] = std::make_pair(roots[i], seen.size() + skipped);
+			}
+		}, 1);
+		return counts;
+	}
+
+	// Makes room in the rankings for one more node before the genealogy is
+	// touched, so that none of the updates below can throw.
+	void reserve_rankings() {
+		by_descendants.reserve(nodes.size() + 1);
+		by_children.reserve(nodes.size() + 1);
+	}
+
+	void insert_ranking_entries(node_index index) noexcept {
+		by_descendants.insert(index, nodes[index].descendants);
+		by_children.insert(index, nodes[index].children.size());
+	}
+
+	void erase_ranking_entries(node_index index) noexcept {
+		by_descendants.erase(index);
+		by_children.erase(index);
+	}
+
+	void set_descendants(const std::vector<std::pair<node_index, std::size_t>> &counts) noexcept {
+		for (auto &count : counts) {
+			by_descendants.move(count.first, count.second);
+			nodes[count.first].descendants = count.second;
+		}
+	}
+
+	void rerank_children(node_index index) noexcept {
+		by_children.move(index, nodes[index].children.size());
+	}
+
+	std::vector<std::pair<id_type, std::size_t>> top_of(const CountRanking &ranking, std::size_t k) const {
+		std::vector<std::pair<id_type, std::size_t>> top;
+		if (!rankings_enabled) {
+			return top;
+		}
+		top.reserve(std::min(k, live_nodes.size()));
+		ranking.for_each_top(k, [&](node_index index, std::size_t count) {
+			top.emplace_back(nodes[index].id, count);
+		});
+		return top;
+	}
+
+	std::size_t depth_of(node_index index) const noexcept {
+		return index == no_node ? 0 : nodes[index].dom_depth;
+	}
+
+	// Collects the dominator subtree of root, which is exactly what
+	// remove() deletes: a child is dominated by root iff its immediate
+	// dominator is, so the walk never has to leave the cascade. Children
+	// left behind are reported in survivors if it is given.
+	std::vector<node_index> collect_cascade(node_index root, std::unordered_set<node_index> &doomed,
+			std::vector<node_index> *survivors) const {
+		std::vector<node_index> cascade(1, root);
+		doomed.insert(root);
+
+		for (std::size_t i = 0; i < cascade.size(); ++i) {
+			for (auto child : nodes[cascade[i]].children) {
+				if (doomed.count(child) != 0) {
+					continue;
+				}
+				if (doomed.count(nodes[child].idom) != 0) {
+					doomed.insert(child);
+					cascade.push_back(child);
+				} else if (survivors != nullptr) {
+					survivors->push_back(child);
+				}
+			}
+		}
+
+		if (survivors != nullptr) {
+			survivors->erase(std::remove_if(survivors->begin(), survivors->end(),
+				[&doomed](node_index survivor) { return doomed.count(survivor) != 0; }),
+				survivors->end());
+		}
+		return cascade;
+	}
+
+	// Counts what collect_cascade() collects, crossing chains in one step:
+	// every virus of a chain after a doomed one is doomed too, and only the
+	// last one of a chain has children outside it.
+	std::size_t count_cascade(node_index root) const {
+		std::unordered_set<node_index> doomed;
+		std::vector<node_index> pending;
+		std::size_t count = 0;
+		auto doom = [&](node_index index) {
+			node_index tail = nodes[nodes[index].chain_head].chain_tail;
+			count += nodes[tail].chain_position - nodes[index].chain_position + 1;
+			doomed.insert(index);
+			doomed.insert(tail);
+			pending.push_back(tail);
+		};
+
+		doom(root);
+		while (!pending.empty()) {
+			node_index current = pending.back();
+			pending.pop_back();
+			for (auto child : nodes[current].children) {
+				if (doomed.count(child) == 0 && doomed.count(nodes[child].idom) != 0) {
+					doom(child);
+				}
+			}
+		}
+		return count;
+	}
+
+	bool unary_link_above(node_index index) const noexcept {
+		const std::vector<node_index> &parents = nodes[index].parents;
+		return parents.size() == 1 && nodes[parents.front()].children.size() == 1;
+	}
+
+	bool unary_link_below(node_index index) const noexcept {
+		const std::vector<node_index> &children = nodes[index].children;
+		return children.size() == 1 && nodes[children.front()].parents.size() == 1;
+	}
+
+	bool is_chain_tail(node_index index) const noexcept {
+		return nodes[nodes[index].chain_head].chain_tail == index;
+	}
+
+	// The child the labels put right after index, or no_node.
+	node_index chain_successor(node_index index) const noexcept {
+		for (auto child : nodes[index].children) {
+			if (nodes[child].chain_head == nodes[index].chain_head
+				&& nodes[child].chain_position == nodes[index].chain_position + 1) {
+				return child;
+			}
+		}
+		return no_node;
+	}
+
+	// Labels from and the viruses after it, up to last or, if last is
+	// no_node, along the unary links, as part of the chain starting at
+	// head with from at position, and returns the last one.
+	node_index label_chain(node_index from, node_index head, std::size_t position, node_index last) noexcept {
+		node_index current = from;
+		for (;;) {
+			node_index next = no_node;
+			if (last == no_node) {
+				next = unary_link_below(current) ? nodes[current].children.front() : no_node;
+			} else if (current != last) {
+				next = chain_successor(current);
+			}
+			nodes[current].chain_head = head;
+			nodes[current].chain_position = position++;
+			if (next == no_node) {
+				break;
+			}
+			current = next;
+		}
+		nodes[head].chain_tail = current;
+		return current;
+	}
+
+	// Makes index, which the labels put after its only parent, the first
+	// virus of a chain of its own.
+	void cut_chain(node_index index) noexcept {
+		node_index head = nodes[index].chain_head;
+		node_index previous = no_node;
+		for (auto parent : nodes[index].parents) {
+			if (nodes[parent].chain_head == head && nodes[parent].chain_position + 1 == nodes[index].chain_position) {
+				previous = parent;
+			}
+		}
+		label_chain(index, index, 0, nodes[head].chain_tail);
+		nodes[head].chain_tail = previous;
+	}
+
+	// Appends the chain starting at second to the one ending at first.
+	void join_chains(node_index first, node_index second) noexcept {
+		label_chain(second, nodes[first].chain_head, nodes[first].chain_position + 1, nodes[second].chain_tail);
+	}
+
+	// Repairs the labels after the adjacency of the given viruses changed.
+	// Links the labels claim that are no longer unary are cut first, so
+	// that every remaining claim holds when the new unary links are joined.
+	void update_chains(const std::vector<node_index> &relinked) noexcept {
+		if (!chains_enabled) {
+			return;
+		}
+
+		for (auto index : relinked) {
+			if (!nodes[index].alive) {
+				continue;
+			}
+			if (nodes[index].chain_position > 0 && !unary_link_above(index)) {
+				cut_chain(index);
+			}
+			if (!is_chain_tail(index) && !unary_link_below(index)) {
+				cut_chain(chain_successor(index));
+			}
+		}
+
+		for (auto index : relinked) {
+			if (!nodes[index].alive) {
+				continue;
+			}
+			if (nodes[index].chain_position == 0 && unary_link_above(index)) {
+				join_chains(nodes[index].parents.front(), index);
+			}
+			if (is_chain_tail(index) && unary_link_below(index)) {
+				join_chains(index, nodes[index].children.front());
+			}
+		}
+	}
+
+	bool chain_labels_valid(node_index index) const noexcept {
+		const VirusNode &node = nodes[index];
+		node_index head = node.chain_head;
+		if (head >= nodes.size() || !nodes[head].alive || nodes[head].chain_tail >= nodes.size()
+			|| nodes[nodes[head].chain_tail].chain_head != head) {
+			return false;
+		}
+		if (is_chain_tail(index) == unary_link_below(index)) {
+			return false;
+		}
+		if (node.chain_position == 0) {
+			return head == index && !unary_link_above(index);
+		}
+		return unary_link_above(index) && nodes[node.parents.front()].chain_head == head
+			&& nodes[node.parents.front()].chain_position + 1 == node.chain_position;
+	}
+
+	// Inside a chain the immediate dominator is the previous virus, and
+	// nothing outside a chain but below its last virus is dominated by a
+	// virus in it, so the climb jumps straight to the first virus of a
+	// chain the other node is not in.
+	node_index common_dominator(node_index a, node_index b) const noexcept {
+		while (a != b) {
+			if (depth_of(a) < depth_of(b)) {
+				std::swap(a, b);
+			}
+			if (chains_enabled && nodes[a].chain_position > 0) {
+				if (b != no_node && nodes[b].chain_head == nodes[a].chain_head) {
+					return b;
+				}
+				a = nodes[a].chain_head;
+				continue;
+			}
+			a = nodes[a].idom;
+		}
+		return a;
+	}
+
+	typedef std::vector<std::pair<node_index, std::size_t>> rank_log;
+
+	// Makes the rank of index at least rank and restores the rank order
+	// below it, logging every previous rank. The new edge into index from
+	// guard closes a cycle iff the walk reaches guard: every virus on a path
+	// from index to guard has a rank below the new one and is raised. Then
+	// TriedToCreateCycle is thrown, and restore_ranks() undoes the walk.
+	void raise_rank(node_index index, std::size_t rank, node_index guard, rank_log &previous) {
+		if (nodes[index].rank >= rank) {
+			return;
+		}
+
+		previous.emplace_back(index, nodes[index].rank);
+		nodes[index].rank = rank;
+		std::vector<node_index> raised(1, index);
+		while (!raised.empty()) {
+			node_index current = raised.back();
+			raised.pop_back();
+			for (auto child : nodes[current].children) {
+				if (nodes[child].rank <= nodes[current].rank) {
+					if (child == guard) {
+						throw TriedToCreateCycle();
+					}
+					previous.emplace_back(child, nodes[child].rank);
+					nodes[child].rank = nodes[current].rank + 1;
+					raised.push_back(child);
+				}
+			}
+		}
+	}
+
+	void restore_ranks(const rank_log &previous) noexcept {
+		for (auto it = previous.rbegin(); it != previous.rend(); ++it) {
+			nodes[it->first].rank = it->second;
+		}
+	}
+
+	// Checks whether a cycle can be reached from seeds, by a depth-first
+	// search over their descendants that meets a virus still on its stack.
+	// The search follows the (parent, child) pairs in added, sorted by
+	// parent, as if they were already edges, so that a batch is checked
+	// before the adjacency lists change.
+	bool reaches_cycle(const std::vector<node_index> &seeds,
+			const std::vector<std::pair<node_index, node_index>> &added) const {
+		enum class mark { open, done };
+		std::unordered_map<node_index, mark> marks;
+		std::vector<std::pair<node_index, std::size_t>> stack;
+		for (auto seed : seeds) {
+			if (!marks.emplace(seed, mark::open).second) {
+				continue;
+			}
+			stack.emplace_back(seed, 0);
+			while (!stack.empty()) {
+				auto &top = stack.back();
+				const std::vector<node_index> &children = nodes[top.first].children;
+				auto extra = std::lower_bound(added.begin(), added.end(),
+					std::make_pair(top.first, node_index(0)));
+				std::size_t extra_count = std::upper_bound(extra, added.end(),
+					std::make_pair(top.first, std::numeric_limits<node_index>::max())) - extra;
+				if (top.second == children.size() + extra_count) {
+					marks[top.first] = mark::done;
+					stack.pop_back();
+					continue;
+				}
+
+				std::size_t position = top.second++;
+				node_index child = position < children.size()
+					? children[position] : extra[position - children.size()].second;
+				auto it = marks.find(child);
+				if (it == marks.end()) {
+					marks.emplace(child, mark::open);
+					stack.emplace_back(child, 0);
+				} else if (it->second == mark::open) {
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	// Recomputes immediate dominators starting from seeds, as if the
+	// excluded nodes were already gone, and returns what changed without
+	// applying it. Nodes are visited in rank order, so all parents are
+	// settled before a child; the search only continues below nodes whose
+	// dominator actually moved, which keeps the cost proportional to the
+	// part of the dominator tree that changes.
+	std::vector<DominatorUpdate> plan_dominators(const std::vector<node_index> &seeds,
+			const std::unordered_set<node_index> &excluded) const {
+		typedef std::pair<std::size_t, node_index> ranked_node;
+		std::priority_queue<ranked_node, std::vector<ranked_node>, std::greater<ranked_node>> pending;
+		std::unordered_set<node_index> queued;
+		std::unordered_map<node_index, std::size_t> planned;
+		std::vector<DominatorUpdate> updates;
+
+		auto idom_of = [&](node_index index) {
+			auto it = planned.find(index);
+			return it == planned.end() ? nodes[index].idom : updates[it->second].idom;
+		};
+		auto planned_depth = [&](node_index index) {
+			auto it = planned.find(index);
+			return it == planned.end() ? depth_of(index) : updates[it->second].dom_depth;
+		};
+
+		for (auto seed : seeds) {
+			if (queued.insert(seed).second) {
+				pending.emplace(nodes[seed].rank, seed);
+			}
+		}
+
+		while (!pending.empty()) {
+			node_index current = pending.top().second;
+			pending.pop();
+			if (nodes[current].stem) {
+				continue;
+			}
+
+			node_index idom = no_node;
+			bool first_parent = true;
+			for (auto parent : nodes[current].parents) {
+				if (excluded.count(parent) != 0) {
+					continue;
+				}
+				if (first_parent) {
+					idom = parent;
+					first_parent = false;
+					continue;
+				}
+				node_index other = parent;
+				while (idom != other) {
+					if (planned_depth(idom) < planned_depth(other)) {
+						std::swap(idom, other);
+					}
+					idom = idom_of(idom);
+				}
+			}
+
+			std::size_t dom_depth = planned_depth(idom) + 1;
+			if (idom == idom_of(current) && dom_depth == planned_depth(current)) {
+				continue;
+			}
+
+			planned[current] = updates.size();
+			updates.push_back(DominatorUpdate{current, idom, dom_depth});
+			for (auto child : nodes[current].children) {
+				if (excluded.count(child) == 0 && queued.insert(child).second) {
+					pending.emplace(nodes[child].rank, child);
+				}
+			}
+		}
+
+		return updates;
+	}
+
+	void apply_dominators(const std::vector<DominatorUpdate> &updates) noexcept {
+		for (auto &update : updates) {
+			nodes[update.node].idom = update.idom;
+			nodes[update.node].dom_depth = update.dom_depth;
+		}
+	}
+
+	std::vector<VirusNode> nodes;
+
+	std::vector<node_index> free_nodes;
+
+	std::vector<node_index> stems;
+
+	IdIndex<id_type, node_index> viruses;
+
+	const id_type stem_id;
+
+	// Source of slot generations, see Handle.
+	std::size_t generations = 0;
+
+	bool rankings_enabled = false;
+
+	CountRanking by_descendants;
+
+	CountRanking by_children;
+
+	// Every live node once, in no particular order, for O(1) sampling.
+	std::vector<node_index> live_nodes;
+
+	bool sketches_enabled = false;
+
+	std::size_t sketch_size = 0;
+
+	bool estimates_enabled = false;
+
+	std::size_t register_precision = 0;
+
+	bool closure_enabled = false;
+
+	bool skipping_implied_edges = false;
+
+	bool skip_keeps_cascades = true;
+
+	bool lazy_payloads = false;
+
+	std::unique_ptr<PayloadStore<Virus>> payload_store;
+
+	bool chains_enabled = false;
+};
+
+// Many stems sharing one id index and one node storage instead of one
+// VirusGenealogy per stem. Viruses may descend from several stems, ids are
+// unique across the whole forest, and remove() refuses to delete any of
+// the stems. A virus descending from several stems is dominated by none
+// of them. lineage(stem_id) returns a view with the VirusGenealogy
+// interface for code written against a single stem; all views see the
+// whole forest, only get_stem_id() differs between them.
+template<class Virus>
+class VirusForest : private VirusGenealogy<Virus> {
+	typedef VirusGenealogy<Virus> genealogy_type;
+
+public:
+	typedef typename Virus::id_type id_type;
+
+	using typename genealogy_type::IdView;
+	using typename genealogy_type::IdRange;
+	using typename genealogy_type::Handle;
+
+	class Lineage {
+	public:
+		id_type get_stem_id() const noexcept {
+			return stem_id;
+		}
+
+		std::vector<id_type> get_children(const id_type& id) const {
+			return forest->get_children(id);
+		}
+
+		std::vector<id_type> get_parents(const id_type& id) const {
+			return forest->get_parents(id);
+		}
+
+		bool exists(const id_type& id) const noexcept {
+			return forest->exists(id);
+		}
+
+		const Virus &operator[](const id_type& id) const {
+			return (*forest)[id];
+		}
+
+		Handle create(const id_type& id, const id_type& parent_id) {
+			return forest->create(id, parent_id);
+		}
+
+		Handle create(const id_type& id, const std::vector<id_type>& parent_ids) {
+			return forest->create(id, parent_ids);
+		}
+
+		void connect(const id_type& child_id, const id_type& parent_id) {
+			forest->connect(child_id, parent_id);
+		}
+
+		void remove(const id_type& id) {
+			forest->remove(id);
+		}
+
+	private:
+		friend class VirusForest;
+
+		Lineage(VirusForest *forest, const id_type &stem_id) : forest(forest), stem_id(stem_id) {}
+
+		VirusForest *forest;
+		id_type stem_id;
+	};
+
+	VirusForest() = delete;
+
+	VirusForest(const VirusForest &) = delete;
+
+	VirusForest &operator=(const VirusForest &) = delete;
+
+	VirusForest(const id_type& first_stem_id) : genealogy_type(first_stem_id) {}
+
+	using genealogy_type::handle;
+	using genealogy_type::get_children;
+	using genealogy_type::get_parents;
+	using genealogy_type::children_view;
+	using genealogy_type::parents_view;
+	using genealogy_type::id_range;
+	using genealogy_type::exists;
+	using genealogy_type::operator[];
+	using genealogy_type::create;
+	using genealogy_type::connect;
+	using genealogy_type::connect_batch;
+	using genealogy_type::remove;
+	using genealogy_type::preview_remove;
+	using genealogy_type::preview_remove_count;
+	using genealogy_type::get_dominator;
+	using genealogy_type::dominates;
+	using genealogy_type::reorder;
+	using genealogy_type::verify;
+	using genealogy_type::for_each_virus;
+	using genealogy_type::parallel_for_each_virus;
+	using genealogy_type::aggregate_descendants;
+	using genealogy_type::enable_rankings;
+	using genealogy_type::top_by_descendants;
+	using genealogy_type::top_by_children;
+	using genealogy_type::enable_ancestry_sketches;
+	using genealogy_type::ancestry_similarity;
+	using genealogy_type::enable_descendant_estimates;
+	using genealogy_type::estimate_descendants;
+	using genealogy_type::descendant_estimate_error;
+	using genealogy_type::enable_closure;
+	using genealogy_type::is_ancestor;
+	using genealogy_type::common_ancestors;
+	using genealogy_type::common_ancestor_count;
+	using genealogy_type::find_redundant_edges;
+	using genealogy_type::drop_redundant_edges;
+	using genealogy_type::skip_implied_edges;
+	using genealogy_type::enable_lazy_payloads;
+	using genealogy_type::enable_payload_store;
+	using genealogy_type::payload;
+	using genealogy_type::enable_chain_compression;
+	using genealogy_type::sample_virus;
+	using genealogy_type::sample_descendants;
+
+	void add_stem(const id_type& stem_id) {
+		genealogy_type::add_stem(stem_id);
+	}
+
+	bool is_stem(const id_type& id) const {
+		return this->nodes[this->get_node(id)].stem;
+	}
+
+	std::vector<id_type> get_stem_ids() const {
+		std::vector<id_type> ids;
+		ids.reserve(this->stems.size());
+		for (auto stem : this->stems) {
+			ids.push_back(this->nodes[stem].id);
+		}
+		return ids;
+	}
+
+	Lineage lineage(const id_type& stem_id) {
+		if (!is_stem(stem_id)) {
+			throw VirusNotFound();
+		}
+		return Lineage(this, stem_id);
+	}
 };
 
-#endif 
+#endif
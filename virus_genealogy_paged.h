@@ -0,0 +1,831 @@
+#ifndef VIRUS_GENEALOGY_PAGED_H
+#define VIRUS_GENEALOGY_PAGED_H
+
+#include "virus_genealogy.h"
+
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <type_traits>
+
+class PageStoreError : public std::exception {
+	virtual const char *what() const throw() {
+		return "PageStoreError";
+	}
+};
+
+// Fixed-size pages in a local scratch file. Pages are copied in and out
+// of a pool of in-memory frames; when every frame is taken, the CLOCK hand
+// evicts the first frame whose reference bit is clear, writing it back
+// first if it is dirty.
+class PageStore {
+public:
+	typedef std::uint64_t page_id;
+
+	static constexpr std::size_t page_size = 4096;
+
+	PageStore(const PageStore &) = delete;
+
+	PageStore &operator=(const PageStore &) = delete;
+
+	PageStore(const std::string &path, std::size_t frame_count)
+		: file(path, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc),
+		frames(frame_count), page_count(0), hand(0) {
+		if (!file || frame_count == 0) {
+			throw PageStoreError();
+		}
+
+		for (auto &frame : frames) {
+			frame.data.reset(new char[page_size]);
+		}
+	}
+
+	~PageStore() {
+		try {
+			flush();
+		} catch (...) {
+		}
+	}
+
+	page_id allocate() {
+		page_id page = page_count;
+		Frame &frame = frames[claim_frame()];
+		std::memset(frame.data.get(), 0, page_size);
+		frame.page = page;
+		frame.used = true;
+		frame.dirty = true;
+		page_table[page] = &frame - frames.data();
+		++page_count;
+		return page;
+	}
+
+	void read(page_id page, std::size_t offset, void *buffer, std::size_t size) {
+		std::memcpy(buffer, frames[fetch(page)].data.get() + offset, size);
+	}
+
+	void write(page_id page, std::size_t offset, const void *buffer, std::size_t size) {
+		Frame &frame = frames[fetch(page)];
+		std::memcpy(frame.data.get() + offset, buffer, size);
+		frame.dirty = true;
+	}
+
+	void flush() {
+		for (auto &frame : frames) {
+			if (frame.used && frame.dirty) {
+				write_back(frame);
+			}
+		}
+		file.flush();
+	}
+
+	std::size_t pages() const noexcept {
+		return page_count;
+	}
+
+private:
+	struct Frame {
+		std::unique_ptr<char[]> data;
+		page_id page = 0;
+		bool used = false;
+		bool dirty = false;
+		bool referenced = false;
+	};
+
+	std::size_t fetch(page_id page) {
+		auto it = page_table.find(page);
+		if (it != page_table.end()) {
+			frames[it->second].referenced = true;
+			return it->second;
+		}
+
+		std::size_t index = claim_frame();
+		Frame &frame = frames[index];
+		file.seekg(static_cast<std::streamoff>(page * page_size));
+		if (!file.read(frame.data.get(), page_size)) {
+			file.clear();
+			throw PageStoreError();
+		}
+		frame.page = page;
+		frame.used = true;
+		frame.dirty = false;
+		frame.referenced = true;
+		page_table[page] = index;
+		return index;
+	}
+
+	std::size_t claim_frame() {
+		for (;;) {
+			Frame &frame = frames[hand];
+			std::size_t index = hand;
+			hand = (hand + 1) % frames.size();
+
+			if (!frame.used) {
+				return index;
+			}
+			if (frame.referenced) {
+				frame.referenced = false;
+				continue;
+			}
+
+			if (frame.dirty) {
+				write_back(frame);
+			}
+			page_table.erase(frame.page);
+			frame.used = false;
+			return index;
+		}
+	}
+
+	void write_back(Frame &frame) {
+		file.seekp(static_cast<std::streamoff>(frame.page * page_size));
+		if (!file.write(frame.data.get(), page_size)) {
+			file.clear();
+			throw PageStoreError();
+		}
+		frame.dirty = false;
+	}
+
+	std::fstream file;
+
+	std::vector<Frame> frames;
+
+	std::unordered_map<page_id, std::size_t> page_table;
+
+	page_id page_count;
+
+	std::size_t hand;
+};
+
+// An ordered map from keys to values laid out as a B+ tree in PageStore
+// pages, like IdIndex in memory: a leaf page holds sorted entries and the
+// page of the next leaf, an inner page sorted separators and the pages of
+// its children. Only the page of the root stays resident. Leaves are not
+// merged when entries are erased; an emptied leaf stays in the tree and
+// takes the keys that fall into its range again later. Key and Value must
+// be trivially copyable and default constructible.
+template<class Key, class Value, class Compare = std::less<Key>>
+class PagedIdIndex {
+public:
+	PagedIdIndex(const PagedIdIndex &) = delete;
+
+	PagedIdIndex &operator=(const PagedIdIndex &) = delete;
+
+	explicit PagedIdIndex(PageStore &store) : store(store), root(store.allocate()), count(0) {
+		Header header{0, 0, no_page};
+		store.write(root, 0, &header, sizeof(header));
+	}
+
+	std::size_t size() const noexcept {
+		return count;
+	}
+
+	// Sets value and returns true if key is in the index.
+	bool find(const Key &key, Value &value) const {
+		LeafPage leaf;
+		load(descend(key, nullptr), leaf);
+		std::size_t position = lower_position(leaf, key);
+		if (position == leaf.header.count || compare(key, leaf.entries[position].key)) {
+			return false;
+		}
+		value = leaf.entries[position].value;
+		return true;
+	}
+
+	// Returns false, leaving the index as it is, if key is already in it.
+	bool insert(const Key &key, const Value &value) {
+		std::vector<std::pair<PageStore::page_id, std::size_t>> path;
+		PageStore::page_id page = descend(key, &path);
+		LeafPage leaf;
+		load(page, leaf);
+		std::size_t position = lower_position(leaf, key);
+		if (position < leaf.header.count && !compare(key, leaf.entries[position].key)) {
+			return false;
+		}
+
+		std::vector<Entry> entries(leaf.entries, leaf.entries + leaf.header.count);
+		entries.insert(entries.begin() + position, Entry{key, value});
+		++count;
+		if (entries.size() <= leaf_capacity) {
+			fill(leaf, entries.begin(), entries.end());
+			store.write(page, 0, &leaf, sizeof(leaf));
+			return true;
+		}
+
+		std::size_t middle = entries.size() / 2;
+		LeafPage right;
+		right.header = Header{0, 0, leaf.header.next};
+		fill(right, entries.begin() + middle, entries.end());
+		PageStore::page_id right_page = store.allocate();
+		store.write(right_page, 0, &right, sizeof(right));
+		leaf.header.next = right_page;
+		fill(leaf, entries.begin(), entries.begin() + middle);
+		store.write(page, 0, &leaf, sizeof(leaf));
+		add_child(path, page, entries[middle].key, right_page);
+		return true;
+	}
+
+	std::size_t erase(const Key &key) {
+		PageStore::page_id page = descend(key, nullptr);
+		LeafPage leaf;
+		load(page, leaf);
+		std::size_t position = lower_position(leaf, key);
+		if (position == leaf.header.count || compare(key, leaf.entries[position].key)) {
+			return 0;
+		}
+
+		std::copy(leaf.entries + position + 1, leaf.entries + leaf.header.count, leaf.entries + position);
+		--leaf.header.count;
+		store.write(page, 0, &leaf, sizeof(leaf));
+		--count;
+		return 1;
+	}
+
+private:
+	static constexpr PageStore::page_id no_page = ~PageStore::page_id(0);
+
+	struct Header {
+		std::uint32_t inner;
+		std::uint32_t count;
+		PageStore::page_id next;
+	};
+
+	struct Entry {
+		Key key;
+		Value value;
+	};
+
+	// Both leave room for the padding the compiler may add.
+	static constexpr std::size_t leaf_capacity =
+		(PageStore::page_size - sizeof(Header) - alignof(Entry)) / sizeof(Entry);
+
+	static constexpr std::size_t inner_capacity =
+		(PageStore::page_size - sizeof(Header) - sizeof(PageStore::page_id) - alignof(Key) - 8)
+		/ (sizeof(Key) + sizeof(PageStore::page_id));
+
+	static_assert(leaf_capacity >= 2 && inner_capacity >= 3, "the key does not fit in a page");
+
+	struct LeafPage {
+		Header header;
+		Entry entries[leaf_capacity];
+	};
+
+	// Child i holds the keys in [keys[i - 1], keys[i]).
+	struct InnerPage {
+		Header header;
+		PageStore::page_id children[inner_capacity + 1];
+		Key keys[inner_capacity];
+	};
+
+	static_assert(sizeof(LeafPage) <= PageStore::page_size && sizeof(InnerPage) <= PageStore::page_size,
+		"index pages overflow PageStore pages");
+
+	template<class Page>
+	void load(PageStore::page_id page, Page &contents) const {
+		store.read(page, 0, &contents, sizeof(contents));
+	}
+
+	template<class Iterator>
+	static void fill(LeafPage &leaf, Iterator begin, Iterator end) {
+		std::copy(begin, end, leaf.entries);
+		leaf.header.count = static_cast<std::uint32_t>(end - begin);
+	}
+
+	std::size_t lower_position(const LeafPage &leaf, const Key &key) const {
+		return std::lower_bound(leaf.entries, leaf.entries + leaf.header.count, key,
+			[this](const Entry &entry, const Key &bound) {
+				return compare(entry.key, bound);
+			}) - leaf.entries;
+	}
+
+	// The leaf whose range holds key. path, if given, gets every inner page
+	// on the way with the position of the child taken.
+	PageStore::page_id descend(const Key &key,
+			std::vector<std::pair<PageStore::page_id, std::size_t>> *path) const {
+		PageStore::page_id page = root;
+		for (;;) {
+			Header header;
+			store.read(page, 0, &header, sizeof(header));
+			if (!header.inner) {
+				return page;
+			}
+
+			InnerPage inner;
+			load(page, inner);
+			std::size_t position = std::upper_bound(inner.keys, inner.keys + inner.header.count, key, compare)
+				- inner.keys;
+			if (path != nullptr) {
+				path->emplace_back(page, position);
+			}
+			page = inner.children[position];
+		}
+	}
+
+	// Hangs right, whose keys start at separator, next to left, splitting
+	// the inner pages on path upwards.
+	void add_child(std::vector<std::pair<PageStore::page_id, std::size_t>> &path,
+			PageStore::page_id left, Key separator, PageStore::page_id right) {
+		while (!path.empty()) {
+			PageStore::page_id page = path.back().first;
+			std::size_t position = path.back().second;
+			path.pop_back();
+
+			InnerPage inner;
+			load(page, inner);
+			std::vector<Key> keys(inner.keys, inner.keys + inner.header.count);
+			std::vector<PageStore::page_id> children(inner.children, inner.children + inner.header.count + 1);
+			keys.insert(keys.begin() + position, separator);
+			children.insert(children.begin() + position + 1, right);
+			if (keys.size() <= inner_capacity) {
+				std::copy(keys.begin(), keys.end(), inner.keys);
+				std::copy(children.begin(), children.end(), inner.children);
+				inner.header.count = static_cast<std::uint32_t>(keys.size());
+				store.write(page, 0, &inner, sizeof(inner));
+				return;
+			}
+
+			std::size_t middle = keys.size() / 2;
+			InnerPage sibling;
+			sibling.header = Header{1, static_cast<std::uint32_t>(keys.size() - middle - 1), no_page};
+			std::copy(keys.begin() + middle + 1, keys.end(), sibling.keys);
+			std::copy(children.begin() + middle + 1, children.end(), sibling.children);
+			inner.header.count = static_cast<std::uint32_t>(middle);
+			std::copy(keys.begin(), keys.begin() + middle, inner.keys);
+			std::copy(children.begin(), children.begin() + middle + 1, inner.children);
+			PageStore::page_id sibling_page = store.allocate();
+			store.write(sibling_page, 0, &sibling, sizeof(sibling));
+			store.write(page, 0, &inner, sizeof(inner));
+
+			left = page;
+			separator = keys[middle];
+			right = sibling_page;
+		}
+
+		InnerPage new_root;
+		new_root.header = Header{1, 1, no_page};
+		new_root.keys[0] = separator;
+		new_root.children[0] = left;
+		new_root.children[1] = right;
+		root = store.allocate();
+		store.write(root, 0, &new_root, sizeof(new_root));
+	}
+
+	PageStore &store;
+
+	PageStore::page_id root;
+
+	std::size_t count;
+
+	Compare compare;
+};
+
+// The VirusGenealogy interface with nodes and adjacency kept in a
+// PageStore, so that the genealogy can outgrow memory. The id index is a
+// PagedIdIndex in the same store; only one page number per page of
+// records, the root of the index and a CLOCK cache of at most
+// cached_payloads payloads stay resident. Adjacency lists are chains of
+// small fixed-size segments packed into pages.
+//
+// Ids are stored verbatim in the pages, so id_type must be trivially
+// copyable. Disk errors are reported as PageStoreError and leave the
+// genealogy in an unspecified state; the file is scratch space, not a
+// persistent format.
+template<class Virus>
+class PagedVirusGenealogy {
+public:
+	typedef typename Virus::id_type id_type;
+
+	static_assert(std::is_trivially_copyable<id_type>::value,
+		"PagedVirusGenealogy stores ids in pages and needs a trivially copyable id_type");
+
+	PagedVirusGenealogy() = delete;
+
+	PagedVirusGenealogy(const PagedVirusGenealogy &) = delete;
+
+	PagedVirusGenealogy &operator=(const PagedVirusGenealogy &) = delete;
+
+	PagedVirusGenealogy(const id_type& stem_id, const std::string &path,
+			std::size_t cached_pages = 1024, std::size_t cached_payloads = 4096)
+		: store(path, cached_pages), node_count(0), free_node(no_record),
+		segment_count(0), free_segment(no_record), viruses(store), payload_capacity(cached_payloads),
+		payload_hand(0), stem_id(stem_id) {
+		stem_index = allocate_node(stem_id);
+		viruses.insert(stem_id, stem_index);
+	}
+
+	id_type get_stem_id() const noexcept {
+		return stem_id;
+	}
+
+	std::vector<id_type> get_children(const id_type& id) const {
+		return ids_of(load_node(get_node(id)).children);
+	}
+
+	std::vector<id_type> get_parents(const id_type& id) const {
+		return ids_of(load_node(get_node(id)).parents);
+	}
+
+	bool exists(const id_type& id) const {
+		record_index index;
+		return viruses.find(id, index);
+	}
+
+	// Returns the virus by value: a reference could only point into the
+	// bounded payload cache, where an unrelated read may evict it.
+	Virus operator[](const id_type& id) const {
+		get_node(id);
+		return Virus(id);
+	}
+
+	// Repeated reads of a virus share one payload while it stays in the
+	// cache, and the pointer keeps it alive after eviction.
+	std::shared_ptr<const Virus> payload(const id_type& id) const {
+		get_node(id);
+		auto it = payload_positions.find(id);
+		if (it != payload_positions.end()) {
+			payloads[it->second].referenced = true;
+			return payloads[it->second].virus;
+		}
+
+		std::shared_ptr<const Virus> virus = std::make_shared<const Virus>(id);
+		if (payloads.size() < payload_capacity) {
+			payload_positions.emplace(id, payloads.size());
+			payloads.push_back(CachedPayload{id, virus, true});
+			return virus;
+		}
+
+		while (payload_capacity > 0) {
+			std::size_t position = payload_hand;
+			payload_hand = (payload_hand + 1) % payloads.size();
+			if (payloads[position].referenced) {
+				payloads[position].referenced = false;
+				continue;
+			}
+
+			payload_positions.erase(payloads[position].id);
+			payloads[position] = CachedPayload{id, virus, true};
+			payload_positions.emplace(id, position);
+			break;
+		}
+		return virus;
+	}
+
+	void create(const id_type& id, const id_type& parent_id) {
+		create(id, std::vector<id_type>(1, parent_id));
+	}
+
+	void create(const id_type& id, const std::vector<id_type>& parent_ids) {
+		if (exists(id)) {
+			throw VirusAlreadyCreated();
+		}
+
+		if (parent_ids.empty()) {
+			throw VirusNotFound();
+		}
+
+		std::vector<record_index> parent_nodes;
+		parent_nodes.reserve(parent_ids.size());
+		for (auto &parent_id : parent_ids) {
+			parent_nodes.push_back(get_node(parent_id));
+		}
+		std::sort(parent_nodes.begin(), parent_nodes.end());
+		parent_nodes.erase(std::unique(parent_nodes.begin(), parent_nodes.end()),
+			parent_nodes.end());
+
+		record_index index = allocate_node(id);
+		viruses.insert(id, index);
+		for (auto parent : parent_nodes) {
+			link(index, parent);
+		}
+	}
+
+	void connect(const id_type& child_id, const id_type& parent_id) {
+		if (!exists(parent_id) || !exists(child_id)) {
+			throw VirusNotFound();
+		}
+
+		record_index parent = get_node(parent_id);
+		record_index child = get_node(child_id);
+		if (!chain_contains(load_node(child).parents, parent)) {
+			link(child, parent);
+		}
+	}
+
+	void remove(const id_type& id) {
+		if (!exists(id)) {
+			throw VirusNotFound();
+		}
+
+		if (id == stem_id) {
+			throw TriedToRemoveStemVirus();
+		}
+
+		std::vector<record_index> to_remove(1, get_node(id));
+		std::unordered_map<record_index, std::uint32_t> removed_parents;
+
+		for (std::size_t i = 0; i < to_remove.size(); ++i) {
+			for (auto child : chain_entries(load_node(to_remove[i]).children)) {
+				if (child != stem_index
+					&& ++removed_parents[child] == load_node(child).parent_count) {
+					to_remove.push_back(child);
+				}
+			}
+		}
+
+		std::unordered_set<record_index> doomed(to_remove.begin(), to_remove.end());
+		for (auto index : to_remove) {
+			NodeRecord node = load_node(index);
+			for (auto parent : chain_entries(node.parents)) {
+				if (doomed.count(parent) == 0) {
+					NodeRecord parent_node = load_node(parent);
+					chain_erase(parent_node.children, index);
+					--parent_node.child_count;
+					store_node(parent, parent_node);
+				}
+			}
+
+			for (auto child : chain_entries(node.children)) {
+				if (doomed.count(child) == 0) {
+					NodeRecord child_node = load_node(child);
+					chain_erase(child_node.parents, index);
+					--child_node.parent_count;
+					store_node(child, child_node);
+				}
+			}
+
+			viruses.erase(node.id);
+			forget_payload(node.id);
+			release_node(index, node);
+		}
+	}
+
+	// Writes every dirty page back to the file.
+	void flush() {
+		store.flush();
+	}
+
+private:
+	typedef std::uint64_t record_index;
+
+	static constexpr record_index no_record = ~record_index(0);
+
+	static constexpr std::size_t segment_capacity = 6;
+
+	// A free node record keeps the next free record in parents.
+	struct NodeRecord {
+		id_type id;
+		record_index parents;
+		record_index children;
+		std::uint32_t parent_count;
+		std::uint32_t child_count;
+	};
+
+	// A free segment keeps the next free segment in next.
+	struct SegmentRecord {
+		record_index next;
+		std::uint64_t count;
+		record_index entries[segment_capacity];
+	};
+
+	static constexpr std::size_t nodes_per_page = PageStore::page_size / sizeof(NodeRecord);
+
+	static constexpr std::size_t segments_per_page = PageStore::page_size / sizeof(SegmentRecord);
+
+	static_assert(nodes_per_page > 0, "id_type does not fit in a page");
+
+	struct CachedPayload {
+		id_type id;
+		std::shared_ptr<const Virus> virus;
+		bool referenced;
+	};
+
+	record_index get_node(const id_type &id) const {
+		record_index index;
+		if (!viruses.find(id, index)) {
+			throw VirusNotFound();
+		}
+		return index;
+	}
+
+	// The last cached payload takes the place of the forgotten one.
+	void forget_payload(const id_type &id) {
+		auto it = payload_positions.find(id);
+		if (it == payload_positions.end()) {
+			return;
+		}
+
+		std::size_t position = it->second;
+		payload_positions.erase(it);
+		if (position + 1 != payloads.size()) {
+			payloads[position] = std::move(payloads.back());
+			payload_positions[payloads[position].id] = position;
+		}
+		payloads.pop_back();
+		if (payload_hand >= payloads.size()) {
+			payload_hand = 0;
+		}
+	}
+
+	NodeRecord load_node(record_index index) const {
+		NodeRecord node;
+		store.read(node_pages[index / nodes_per_page],
+			(index % nodes_per_page) * sizeof(NodeRecord), &node, sizeof(node));
+		return node;
+	}
+
+	void store_node(record_index index, const NodeRecord &node) {
+		store.write(node_pages[index / nodes_per_page],
+			(index % nodes_per_page) * sizeof(NodeRecord), &node, sizeof(node));
+	}
+
+	SegmentRecord load_segment(record_index index) const {
+		SegmentRecord segment;
+		store.read(segment_pages[index / segments_per_page],
+			(index % segments_per_page) * sizeof(SegmentRecord), &segment, sizeof(segment));
+		return segment;
+	}
+
+	void store_segment(record_index index, const SegmentRecord &segment) {
+		store.write(segment_pages[index / segments_per_page],
+			(index % segments_per_page) * sizeof(SegmentRecord), &segment, sizeof(segment));
+	}
+
+	record_index allocate_node(const id_type &id) {
+		record_index index = free_node;
+		if (index != no_record) {
+			free_node = load_node(index).parents;
+		} else {
+			if (node_count % nodes_per_page == 0) {
+				node_pages.push_back(store.allocate());
+			}
+			index = node_count++;
+		}
+
+		store_node(index, NodeRecord{id, no_record, no_record, 0, 0});
+		return index;
+	}
+
+	void release_node(record_index index, const NodeRecord &node) {
+		release_chain(node.parents);
+		release_chain(node.children);
+		store_node(index, NodeRecord{node.id, free_node, no_record, 0, 0});
+		free_node = index;
+	}
+
+	record_index allocate_segment(record_index next) {
+		record_index index = free_segment;
+		if (index != no_record) {
+			free_segment = load_segment(index).next;
+		} else {
+			if (segment_count % segments_per_page == 0) {
+				segment_pages.push_back(store.allocate());
+			}
+			index = segment_count++;
+		}
+
+		SegmentRecord segment = SegmentRecord();
+		segment.next = next;
+		store_segment(index, segment);
+		return index;
+	}
+
+	void release_chain(record_index head) {
+		while (head != no_record) {
+			SegmentRecord segment = load_segment(head);
+			record_index next = segment.next;
+			segment.next = free_segment;
+			store_segment(head, segment);
+			free_segment = head;
+			head = next;
+		}
+	}
+
+	void link(record_index child, record_index parent) {
+		NodeRecord child_node = load_node(child);
+		chain_insert(child_node.parents, parent);
+		++child_node.parent_count;
+		store_node(child, child_node);
+
+		NodeRecord parent_node = load_node(parent);
+		chain_insert(parent_node.children, child);
+		++parent_node.child_count;
+		store_node(parent, parent_node);
+	}
+
+	// New entries go to the head segment, which is the only one that may
+	// be partially filled.
+	void chain_insert(record_index &head, record_index value) {
+		if (head == no_record || load_segment(head).count == segment_capacity) {
+			head = allocate_segment(head);
+		}
+
+		SegmentRecord segment = load_segment(head);
+		segment.entries[segment.count++] = value;
+		store_segment(head, segment);
+	}
+
+	// Fills the hole with the last entry of the head segment and drops the
+	// head segment once it is empty.
+	void chain_erase(record_index &head, record_index value) {
+		for (record_index current = head; current != no_record;) {
+			SegmentRecord segment = load_segment(current);
+			for (std::size_t i = 0; i < segment.count; ++i) {
+				if (segment.entries[i] != value) {
+					continue;
+				}
+
+				SegmentRecord first = current == head ? segment : load_segment(head);
+				segment.entries[i] = first.entries[first.count - 1];
+				if (current == head) {
+					segment.count--;
+					first = segment;
+				} else {
+					store_segment(current, segment);
+					first.count--;
+				}
+
+				if (first.count == 0) {
+					record_index next = first.next;
+					first.next = free_segment;
+					store_segment(head, first);
+					free_segment = head;
+					head = next;
+				} else {
+					store_segment(head, first);
+				}
+				return;
+			}
+			current = segment.next;
+		}
+	}
+
+	bool chain_contains(record_index head, record_index value) const {
+		while (head != no_record) {
+			SegmentRecord segment = load_segment(head);
+			for (std::size_t i = 0; i < segment.count; ++i) {
+				if (segment.entries[i] == value) {
+					return true;
+				}
+			}
+			head = segment.next;
+		}
+		return false;
+	}
+
+	std::vector<record_index> chain_entries(record_index head) const {
+		std::vector<record_index> entries;
+		while (head != no_record) {
+			SegmentRecord segment = load_segment(head);
+			entries.insert(entries.end(), segment.entries, segment.entries + segment.count);
+			head = segment.next;
+		}
+		return entries;
+	}
+
+	std::vector<id_type> ids_of(record_index head) const {
+		std::vector<id_type> ids;
+		for (auto index : chain_entries(head)) {
+			ids.push_back(load_node(index).id);
+		}
+		return ids;
+	}
+
+	mutable PageStore store;
+
+	std::vector<PageStore::page_id> node_pages;
+
+	record_index node_count;
+
+	record_index free_node;
+
+	std::vector<PageStore::page_id> segment_pages;
+
+	record_index segment_count;
+
+	record_index free_segment;
+
+	PagedIdIndex<id_type, record_index> viruses;
+
+	const std::size_t payload_capacity;
+
+	mutable std::vector<CachedPayload> payloads;
+
+	mutable std::map<id_type, std::size_t> payload_positions;
+
+	mutable std::size_t payload_hand;
+
+	const id_type stem_id;
+
+	record_index stem_index;
+};
+
+#endif
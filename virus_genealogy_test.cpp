@@ -0,0 +1,149 @@
+// Regression tests of VirusGenealogy: rejected edges must leave the
+// genealogy exactly as it was, with every optional index switched on.
+// Build it on its own and run it; it exits non-zero and names the case
+// that failed.
+//
+//     g++ -std=c++17 -O2 -pthread virus_genealogy_test.cpp -o virus_genealogy_test
+
+#include "virus_genealogy.h"
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <iostream>
+
+namespace {
+
+class Virus {
+public:
+	typedef int id_type;
+
+	Virus(id_type id) : id(id) {}
+
+	id_type get_id() const {
+		return id;
+	}
+
+private:
+	id_type id;
+};
+
+int failures = 0;
+
+void expect(const char *name, bool holds) {
+	if (!holds) {
+		std::cerr << name << '\n';
+		++failures;
+	}
+}
+
+template<class Function>
+bool creates_cycle(Function f) {
+	try {
+		f();
+	} catch (const TriedToCreateCycle &) {
+		return true;
+	}
+	return false;
+}
+
+void enable_all(VirusGenealogy<Virus> &genealogy) {
+	genealogy.enable_chain_compression();
+	genealogy.enable_rankings();
+	genealogy.enable_ancestry_sketches();
+	genealogy.enable_descendant_estimates();
+	genealogy.enable_closure();
+}
+
+// The edge from the stem to a virus below it closes a cycle through the
+// chain 0 -> 1.
+void connect_closing_cycle() {
+	VirusGenealogy<Virus> genealogy(0);
+	genealogy.enable_chain_compression();
+	genealogy.create(1, 0);
+	genealogy.create(2, 0);
+	expect("connect(0, 1) not rejected", creates_cycle([&] {
+		genealogy.connect(0, 1);
+	}));
+	expect("connect(0, 1) left the genealogy inconsistent", genealogy.verify().empty());
+	expect("connect(0, 1) left an edge behind",
+		genealogy.get_parents(0).empty() && genealogy.get_children(1).empty());
+
+	genealogy.connect(2, 1);
+	expect("connect(2, 1) after the rejected edge", genealogy.verify().empty());
+}
+
+// Neither edge of the batch closes a cycle alone; together they do.
+void connect_batch_closing_cycle() {
+	VirusGenealogy<Virus> genealogy(0);
+	enable_all(genealogy);
+	genealogy.create(1, 0);
+	genealogy.create(2, 0);
+	genealogy.create(3, 1);
+	expect("connect_batch({0, 3}, {2, 1}) not rejected", creates_cycle([&] {
+		genealogy.connect_batch({{0, 3}, {2, 1}});
+	}));
+	expect("connect_batch({0, 3}, {2, 1}) left the genealogy inconsistent",
+		genealogy.verify().empty());
+	expect("connect_batch({0, 3}, {2, 1}) left an edge behind",
+		genealogy.get_parents(2) == std::vector<int>{0}
+		&& genealogy.get_parents(0).empty());
+
+	genealogy.connect_batch({{2, 1}, {3, 2}});
+	expect("connect_batch after the rejected batch", genealogy.verify().empty());
+	expect("connect_batch after the rejected batch lost an edge",
+		genealogy.get_parents(2) == std::vector<int>({0, 1}));
+}
+
+// A batch whose edges survive deduplication as a single one takes the
+// single edge path.
+void connect_batch_single_cycle() {
+	VirusGenealogy<Virus> genealogy(0);
+	enable_all(genealogy);
+	genealogy.create(1, 0);
+	genealogy.create(2, 1);
+	expect("connect_batch({1, 2}) not rejected", creates_cycle([&] {
+		genealogy.connect_batch({{1, 2}, {1, 2}});
+	}));
+	expect("connect_batch({1, 2}) left the genealogy inconsistent", genealogy.verify().empty());
+}
+
+// A second stem of a forest must not get a parent.
+void connect_stem_of_forest() {
+	VirusForest<Virus> forest(0);
+	forest.add_stem(100);
+	forest.create(1, 0);
+	bool thrown = false;
+	try {
+		forest.connect(100, 1);
+	} catch (const TriedToConnectStemVirus &) {
+		thrown = true;
+	}
+	expect("connect(100, 1) to a stem not rejected", thrown);
+
+	thrown = false;
+	forest.create(2, 0);
+	try {
+		forest.connect_batch({{100, 1}, {2, 1}});
+	} catch (const TriedToConnectStemVirus &) {
+		thrown = true;
+	}
+	expect("connect_batch to a stem not rejected", thrown);
+	expect("connecting a stem left the forest inconsistent", forest.verify().empty());
+	expect("connecting a stem left an edge behind",
+		forest.get_parents(100).empty() && forest.get_parents(2) == std::vector<int>{0});
+}
+
+}
+
+int main() {
+	connect_closing_cycle();
+	connect_batch_closing_cycle();
+	connect_batch_single_cycle();
+	connect_stem_of_forest();
+
+	if (failures == 0) {
+		std::cout << "all genealogy tests pass\n";
+	}
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,370 @@
+#ifndef VIRUS_INGEST_H
+#define VIRUS_INGEST_H
+
+#include "virus_genealogy.h"
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <sstream>
+#include <istream>
+#include <ostream>
+#include <utility>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <cstddef>
+
+class IngestFormatError : public std::exception {
+	virtual const char *what() const throw() {
+		return "IngestFormatError";
+	}
+};
+
+// A bounded queue between exactly one producer thread and one consumer
+// thread. push() blocks while the queue is full, which is what throttles a
+// fast stage to the pace of the one after it. close() ends the stream:
+// pop() drains what is left and then returns false, push() returns false
+// at once, so either side can stop the other.
+template<class T>
+class SpscQueue {
+public:
+	SpscQueue(const SpscQueue &) = delete;
+
+	SpscQueue &operator=(const SpscQueue &) = delete;
+
+	explicit SpscQueue(std::size_t capacity) : capacity(std::max<std::size_t>(capacity, 1)), closed(false) {}
+
+	bool push(T value) {
+		std::unique_lock<std::mutex> lock(mutex);
+		not_full.wait(lock, [this] { return closed || items.size() < capacity; });
+		if (closed) {
+			return false;
+		}
+
+		items.push_back(std::move(value));
+		lock.unlock();
+		not_empty.notify_one();
+		return true;
+	}
+
+	bool pop(T &value) {
+		std::unique_lock<std::mutex> lock(mutex);
+		not_empty.wait(lock, [this] { return closed || !items.empty(); });
+		if (items.empty()) {
+			return false;
+		}
+
+		value = std::move(items.front());
+		items.pop_front();
+		lock.unlock();
+		not_full.notify_one();
+		return true;
+	}
+
+	void close() noexcept {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			closed = true;
+		}
+		not_empty.notify_all();
+		not_full.notify_all();
+	}
+
+private:
+	const std::size_t capacity;
+
+	std::deque<T> items;
+
+	bool closed;
+
+	std::mutex mutex;
+
+	std::condition_variable not_empty;
+
+	std::condition_variable not_full;
+};
+
+// One line of the ingestion format:
+//
+//   create <id> <parent_id>...
+//   connect <child_id> <parent_id>
+//   remove <id>
+//
+// Ids are read with operator>> and written with operator<<. Blank lines
+// and lines starting with '#' are skipped.
+template<class id_type>
+struct IngestRecord {
+	enum Kind {
+		create,
+		connect,
+		remove
+	};
+
+	Kind kind;
+	std::vector<id_type> ids;
+
+	// Writes the record as one line of the format above.
+	void write(std::ostream &out) const {
+		static const char *const keywords[] = {"create", "connect", "remove"};
+		out << keywords[kind];
+		for (auto &id : ids) {
+			out << ' ' << id;
+		}
+		out << '\n';
+	}
+};
+
+// Feeds a stream of records into a VirusGenealogy or a VirusForest, with
+// parsing, validation and application on three threads linked by bounded
+// queues. Only the thread calling run() touches the genealogy. Records
+// travel in chunks to keep the queues off the profile, and runs of
+// connect records are applied with a single connect_batch().
+//
+// Records are applied in stream order. If one fails, be it a malformed
+// line or an exception from the genealogy, the stages stop, everything
+// before it stays applied, records_applied() tells how far it got and run()
+// rethrows the earliest error in stream order.
+template<class Genealogy>
+class IngestPipeline {
+public:
+	typedef typename Genealogy::id_type id_type;
+	typedef IngestRecord<id_type> record_type;
+
+	static constexpr std::size_t chunk_size = 256;
+
+	IngestPipeline(const IngestPipeline &) = delete;
+
+	IngestPipeline &operator=(const IngestPipeline &) = delete;
+
+	// queue_chunks bounds how many chunks each queue holds before the stage
+	// feeding it has to wait.
+	IngestPipeline(Genealogy &genealogy, std::size_t queue_chunks = 64)
+		: genealogy(genealogy), queue_chunks(queue_chunks), applied(0) {}
+
+	// Reads input to the end and returns once every record is applied.
+	std::size_t run(std::istream &input) {
+		SpscQueue<std::vector<record_type>> parsed(queue_chunks);
+		SpscQueue<std::vector<record_type>> validated(queue_chunks);
+		std::exception_ptr parse_error;
+		std::exception_ptr validate_error;
+		std::exception_ptr apply_error;
+
+		std::thread parser([&] {
+			run_stage(parse_error, nullptr, parsed, [&] { parse(input, parsed); });
+		});
+		std::thread validator;
+		try {
+			validator = std::thread([&] {
+				run_stage(validate_error, &parsed, validated, [&] { validate(parsed, validated); });
+			});
+		} catch (...) {
+			parsed.close();
+			parser.join();
+			throw;
+		}
+
+		try {
+			apply(validated);
+		} catch (...) {
+			apply_error = std::current_exception();
+		}
+		validated.close();
+		parsed.close();
+		parser.join();
+		validator.join();
+
+		// A downstream stage only ever saw records from before an upstream
+		// failure, so its error comes first in the stream.
+		for (auto &error : {apply_error, validate_error, parse_error}) {
+			if (error) {
+				std::rethrow_exception(error);
+			}
+		}
+		return applied;
+	}
+
+	std::size_t records_applied() const noexcept {
+		return applied;
+	}
+
+private:
+	typedef std::vector<record_type> chunk;
+
+	// Runs a stage that feeds output. An error is kept for run(), and the
+	// input, if any, is closed so the stage before stops too; the output is
+	// closed in any case so the stage after drains it and finishes.
+	template<class Stage>
+	static void run_stage(std::exception_ptr &error, SpscQueue<chunk> *input, SpscQueue<chunk> &output,
+			Stage stage) noexcept {
+		try {
+			stage();
+		} catch (...) {
+			error = std::current_exception();
+			if (input) {
+				input->close();
+			}
+		}
+		output.close();
+	}
+
+	// Passes on the records parsed so far, then fails on a malformed line.
+	[[noreturn]] static void reject(chunk &records, SpscQueue<chunk> &output) {
+		if (!records.empty()) {
+			output.push(std::move(records));
+		}
+		throw IngestFormatError();
+	}
+
+	static void parse(std::istream &input, SpscQueue<chunk> &output) {
+		chunk records;
+		records.reserve(chunk_size);
+		std::string text;
+		std::string keyword;
+
+		while (std::getline(input, text)) {
+			std::istringstream fields(text);
+			if (!(fields >> keyword) || keyword[0] == '#') {
+				continue;
+			}
+
+			record_type record;
+			if (keyword == "create") {
+				record.kind = record_type::create;
+			} else if (keyword == "connect") {
+				record.kind = record_type::connect;
+			} else if (keyword == "remove") {
+				record.kind = record_type::remove;
+			} else {
+				reject(records, output);
+			}
+
+			id_type id;
+			while (fields >> id) {
+				record.ids.push_back(id);
+			}
+			if (!fields.eof()) {
+				reject(records, output);
+			}
+
+			records.push_back(std::move(record));
+			if (records.size() == chunk_size) {
+				if (!output.push(std::move(records))) {
+					return;
+				}
+				records.clear();
+				records.reserve(chunk_size);
+			}
+		}
+
+		if (input.bad()) {
+			reject(records, output);
+		}
+		if (!records.empty()) {
+			output.push(std::move(records));
+		}
+	}
+
+	// Checks what can be checked without the genealogy: the number of ids
+	// per record and connect records joining a virus to itself. Repeated
+	// parents of a create record are dropped. The records before an invalid
+	// one are still passed on.
+	static void validate(SpscQueue<chunk> &input, SpscQueue<chunk> &output) {
+		chunk records;
+		while (input.pop(records)) {
+			for (std::size_t i = 0; i < records.size(); ++i) {
+				record_type &record = records[i];
+				bool valid = false;
+				switch (record.kind) {
+				case record_type::create:
+					valid = record.ids.size() >= 2;
+					if (valid) {
+						std::sort(record.ids.begin() + 1, record.ids.end());
+						record.ids.erase(std::unique(record.ids.begin() + 1, record.ids.end()),
+							record.ids.end());
+					}
+					break;
+				case record_type::connect:
+					valid = record.ids.size() == 2 && !(record.ids[0] == record.ids[1]);
+					break;
+				case record_type::remove:
+					valid = record.ids.size() == 1;
+					break;
+				}
+
+				if (!valid) {
+					records.resize(i);
+					output.push(std::move(records));
+					throw IngestFormatError();
+				}
+			}
+
+			if (!output.push(std::move(records))) {
+				return;
+			}
+		}
+	}
+
+	// The single writer. Consecutive connect records are collected and
+	// applied together when another kind of record or the end of the
+	// stream comes.
+	void apply(SpscQueue<chunk> &input) {
+		std::vector<std::pair<id_type, id_type>> edges;
+		chunk records;
+
+		while (input.pop(records)) {
+			for (auto &record : records) {
+				if (record.kind == record_type::connect) {
+					edges.emplace_back(record.ids[0], record.ids[1]);
+					continue;
+				}
+
+				flush_edges(edges);
+				if (record.kind == record_type::create) {
+					std::vector<id_type> parent_ids(record.ids.begin() + 1, record.ids.end());
+					genealogy.create(record.ids[0], parent_ids);
+				} else {
+					genealogy.remove(record.ids[0]);
+				}
+				++applied;
+			}
+		}
+
+		flush_edges(edges);
+	}
+
+	// connect_batch() is all or nothing, so on failure the edges are
+	// replayed one by one to apply exactly those before the bad one.
+	void flush_edges(std::vector<std::pair<id_type, id_type>> &edges) {
+		if (edges.empty()) {
+			return;
+		}
+
+		bool batched = true;
+		try {
+			genealogy.connect_batch(edges);
+		} catch (...) {
+			batched = false;
+		}
+
+		if (batched) {
+			applied += edges.size();
+		} else {
+			for (auto &edge : edges) {
+				genealogy.connect(edge.first, edge.second);
+				++applied;
+			}
+		}
+		edges.clear();
+	}
+
+	Genealogy &genealogy;
+
+	const std::size_t queue_chunks;
+
+	std::size_t applied;
+};
+
+#endif
@@ -0,0 +1,202 @@
+#ifndef VIRUS_PAYLOAD_STORE_H
+#define VIRUS_PAYLOAD_STORE_H
+
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <istream>
+#include <ostream>
+#include <mutex>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+
+class PayloadStoreError : public std::exception {
+	virtual const char *what() const throw() {
+		return "PayloadStoreError";
+	}
+};
+
+// How PayloadStore turns a Virus into bytes and back. The default calls
+// virus.write(out) and Virus::read(in), which returns a
+// std::unique_ptr<Virus>; specialize it for payloads without those
+// members.
+template<class Virus>
+struct PayloadCodec {
+	static void write(std::ostream &out, const Virus &virus) {
+		virus.write(out);
+	}
+
+	static std::unique_ptr<Virus> read(std::istream &in) {
+		return Virus::read(in);
+	}
+};
+
+// Payloads appended to a local scratch file, each as its encoded length
+// followed by the bytes from PayloadCodec, and addressed by the offset
+// append() returns. load() decodes a payload into a cache holding at most
+// cache_bytes of encoded payloads; when it is full, the CLOCK hand evicts
+// the first entry whose reference bit is clear. Evicted payloads live on
+// as long as someone holds their pointer; read() decodes a copy of its
+// own. Records are never rewritten, so the file only grows. All calls may be made concurrently.
+//
+// The codec is held as two function pointers, so that PayloadCodec is
+// only instantiated where a store is constructed.
+template<class Virus>
+class PayloadStore {
+public:
+	typedef std::uint64_t offset_type;
+
+	typedef void (*encoder)(std::ostream &, const Virus &);
+
+	typedef std::unique_ptr<Virus> (*decoder)(std::istream &);
+
+	PayloadStore(const PayloadStore &) = delete;
+
+	PayloadStore &operator=(const PayloadStore &) = delete;
+
+	PayloadStore(const std::string &path, std::size_t cache_bytes,
+			encoder encode = &PayloadCodec<Virus>::write, decoder decode = &PayloadCodec<Virus>::read)
+		: file(path, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc),
+		encode(encode), decode_payload(decode), cache_bytes(cache_bytes), cached_bytes(0), end(0), hand(0) {
+		if (!file) {
+			throw PayloadStoreError();
+		}
+	}
+
+	offset_type append(const Virus &virus) {
+		std::ostringstream encoded(std::ios::binary);
+		encode(encoded, virus);
+		std::string bytes = encoded.str();
+		std::uint64_t size = bytes.size();
+
+		std::lock_guard<std::mutex> lock(mutex);
+		file.seekp(static_cast<std::streamoff>(end));
+		if (!file.write(reinterpret_cast<const char *>(&size), sizeof(size))
+			|| !file.write(bytes.data(), static_cast<std::streamsize>(bytes.size()))) {
+			file.clear();
+			throw PayloadStoreError();
+		}
+
+		offset_type offset = end;
+		end += sizeof(size) + size;
+		return offset;
+	}
+
+	// Decodes a fresh copy, bypassing the cache.
+	std::unique_ptr<Virus> read(offset_type offset) {
+		std::lock_guard<std::mutex> lock(mutex);
+		std::size_t size;
+		return decode(offset, size);
+	}
+
+	std::shared_ptr<const Virus> load(offset_type offset) {
+		std::lock_guard<std::mutex> lock(mutex);
+		std::size_t size;
+		return cache(offset, size);
+	}
+
+	// The encoded size of the cached payloads; it exceeds cache_bytes only
+	// while the single cached payload does.
+	std::size_t cached() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return cached_bytes;
+	}
+
+private:
+	struct Entry {
+		offset_type offset;
+		std::shared_ptr<const Virus> virus;
+		std::size_t size;
+		bool referenced;
+	};
+
+	std::shared_ptr<const Virus> cache(offset_type offset, std::size_t &size) {
+		auto it = positions.find(offset);
+		if (it != positions.end()) {
+			entries[it->second].referenced = true;
+			size = entries[it->second].size;
+			return entries[it->second].virus;
+		}
+
+		std::shared_ptr<const Virus> virus(decode(offset, size));
+		make_room(size);
+		positions.emplace(offset, entries.size());
+		entries.push_back(Entry{offset, virus, size, true});
+		cached_bytes += size;
+		return virus;
+	}
+
+	std::unique_ptr<Virus> decode(offset_type offset, std::size_t &size) {
+		std::uint64_t length;
+		file.seekg(static_cast<std::streamoff>(offset));
+		if (!file.read(reinterpret_cast<char *>(&length), sizeof(length))) {
+			file.clear();
+			throw PayloadStoreError();
+		}
+
+		std::string bytes(length, '\0');
+		if (!file.read(&bytes[0], static_cast<std::streamsize>(length))) {
+			file.clear();
+			throw PayloadStoreError();
+		}
+
+		std::istringstream encoded(bytes, std::ios::binary);
+		auto virus = decode_payload(encoded);
+		if (!virus) {
+			throw PayloadStoreError();
+		}
+		size = length;
+		return virus;
+	}
+
+	// An evicted entry is replaced by the last one, which the hand then
+	// looks at next.
+	void make_room(std::size_t size) {
+		while (!entries.empty() && cached_bytes + size > cache_bytes) {
+			if (hand >= entries.size()) {
+				hand = 0;
+			}
+
+			Entry &entry = entries[hand];
+			if (entry.referenced) {
+				entry.referenced = false;
+				++hand;
+				continue;
+			}
+
+			cached_bytes -= entry.size;
+			positions.erase(entry.offset);
+			if (hand + 1 != entries.size()) {
+				entry = std::move(entries.back());
+				positions[entry.offset] = hand;
+			}
+			entries.pop_back();
+		}
+	}
+
+	std::fstream file;
+
+	const encoder encode;
+
+	const decoder decode_payload;
+
+	const std::size_t cache_bytes;
+
+	std::size_t cached_bytes;
+
+	offset_type end;
+
+	std::vector<Entry> entries;
+
+	std::unordered_map<offset_type, std::size_t> positions;
+
+	std::size_t hand;
+
+	std::mutex mutex;
+};
+
+#endif